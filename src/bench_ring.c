@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "dgw_ring.h"
+
+/* Measures dgw_ring_plan() and summarizes the transaction plans it
+   produces for different numbers of new records per poll. A sequence
+   mode poll makes one transaction for the sequence number plus one per
+   read, a snapshot poll always reads the whole ring in one. */
+
+#define DEFAULT_PLANS 20000000
+
+typedef struct PlanSummary PlanSummary;
+struct PlanSummary
+{
+  guint64 plans;
+  guint64 reads[3];
+  guint64 registers;
+  guint64 records;
+};
+
+static void
+summarize(PlanSummary *sum, const DgwRingPlan *plan)
+{
+  guint r;
+  sum->plans++;
+  sum->reads[plan->n_reads]++;
+  sum->records += plan->n_records;
+  for (r = 0; r < plan->n_reads; r++) sum->registers += plan->reads[r].count;
+}
+
+static void
+print_summary(const char *name, const PlanSummary *sum)
+{
+  guint64 polls = sum->plans - sum->reads[0];
+  double reads = sum->reads[1] + 2.0 * sum->reads[2];
+  if (polls == 0) return;
+  printf("%-12s %5.1f%% split, %.2f transactions and %.1f registers"
+	 " per poll, %.3f transactions per record (snapshot %.3f)\n", name,
+	 100.0 * sum->reads[2] / polls, (polls + reads) / polls,
+	 (double)sum->registers / polls,
+	 (polls + reads) / sum->records, (double)polls / sum->records);
+}
+
+int
+main(int argc, char *argv[])
+{
+  static const guint max_new[] = {1, 4, 12, DGW_MAX_RECORDS};
+  guint64 n = argc > 1 ? g_ascii_strtoull(argv[1], NULL, 10) : DEFAULT_PLANS;
+  volatile guint sink = 0;
+  DgwRingPlan plan;
+  PlanSummary sum;
+  gint64 start;
+  gint64 elapsed;
+  uint16_t seq = 0;
+  guint i;
+  guint64 p;
+  if (n == 0) n = DEFAULT_PLANS;
+
+  start = g_get_monotonic_time();
+  for (p = 0; p < n; p++) {
+    uint16_t last_seq = seq;
+    seq += p % (DGW_MAX_RECORDS + 1);
+    dgw_ring_plan(&plan, last_seq, seq);
+    sink += plan.n_reads;
+  }
+  elapsed = g_get_monotonic_time() - start;
+  printf("%" G_GUINT64_FORMAT " plans in %.3f s, %.2f ns per plan\n",
+	 n, elapsed / 1e6, elapsed * 1000.0 / n);
+
+  /* New records per poll uniform in 1..max */
+  for (i = 0; i < G_N_ELEMENTS(max_new); i++) {
+    char name[32];
+    memset(&sum, 0, sizeof(sum));
+    seq = 0;
+    srand(1);
+    for (p = 0; p < 1000000; p++) {
+      uint16_t last_seq = seq;
+      seq += 1 + rand() % max_new[i];
+      dgw_ring_plan(&plan, last_seq, seq);
+      summarize(&sum, &plan);
+    }
+    g_snprintf(name, sizeof(name), "1-%u new", max_new[i]);
+    print_summary(name, &sum);
+  }
+  return 0;
+}
@@ -0,0 +1,965 @@
+#include "capture.h"
+#include "dgw_error.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+struct CaptureWriter
+{
+  gchar *prefix;
+  guint64 max_size;
+  gint64 max_age;
+  gint64 commit_interval;
+  gint64 sync_interval;
+
+  int fd;
+  int index_fd;
+  guint64 offset; /* Of the current block, or the next one */
+  gint64 opened;
+  gboolean dirty; /* Written since the last fdatasync */
+  gint64 synced;
+  guint64 next_seq;
+
+  guint8 payload[CAPTURE_BLOCK_RECORDS * CAPTURE_RECORD_MAX_SIZE];
+  gsize payload_len;
+  /* The current block is open in the file with this much payload */
+  gboolean block_open;
+  gsize written;
+  gint64 uncommitted; /* Time of the first record not written */
+  guint32 n_records;
+  gint64 first_time;
+  gint64 prev_time;
+  uint16_t prev_flags;
+};
+
+static guint8 *
+put_u32(guint8 *p, guint32 v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+  return p + 4;
+}
+
+static guint8 *
+put_u64(guint8 *p, guint64 v)
+{
+  p = put_u32(p, v);
+  return put_u32(p, v >> 32);
+}
+
+static guint32
+get_u32(const guint8 *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32)p[3] << 24);
+}
+
+static guint64
+get_u64(const guint8 *p)
+{
+  return get_u32(p) | ((guint64)get_u32(p + 4) << 32);
+}
+
+static guint8 *
+put_varint(guint8 *p, guint64 v)
+{
+  while (v >= 0x80) {
+    *p++ = v | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+static gboolean
+get_varint(const guint8 **pp, const guint8 *end, guint64 *v)
+{
+  const guint8 *p = *pp;
+  guint shift = 0;
+  *v = 0;
+  while (p < end && shift < 64) {
+    guint8 b = *p++;
+    *v |= (guint64)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *pp = p;
+      return TRUE;
+    }
+    shift += 7;
+  }
+  return FALSE;
+}
+
+static guint64
+zigzag(gint64 v)
+{
+  return ((guint64)v << 1) ^ (guint64)(v >> 63);
+}
+
+static gint64
+unzigzag(guint64 v)
+{
+  return (gint64)(v >> 1) ^ -(gint64)(v & 1);
+}
+
+static guint32 crc_table[256];
+
+static guint32
+crc32_update(guint32 crc, const guint8 *p, gsize len)
+{
+  static gsize table_done = 0;
+  if (g_once_init_enter(&table_done)) {
+    guint32 i;
+    for (i = 0; i < 256; i++) {
+      guint32 c = i;
+      int k;
+      for (k = 0; k < 8; k++) {
+	c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      crc_table[i] = c;
+    }
+    g_once_init_leave(&table_done, 1);
+  }
+  crc = ~crc;
+  while (len-- > 0) {
+    crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+/* CRC-32 of a version 2 block, skipping the CRC field at offset 28 */
+static guint32
+block_crc(const guint8 *header, const guint8 *payload, gsize payload_len)
+{
+  guint32 crc = crc32_update(0, header, 28);
+  crc = crc32_update(crc, header + 32, CAPTURE_BLOCK_HEADER_SIZE - 32);
+  return crc32_update(crc, payload, payload_len);
+}
+
+static gboolean
+write_all(int fd, const guint8 *buf, gsize len, GError **err)
+{
+  while (len > 0) {
+    ssize_t w = write(fd, buf, len);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      g_set_error(err, DGW_ERROR, DGW_ERROR_WRITE,
+		  "Failed to write capture file: %s", g_strerror(errno));
+      return FALSE;
+    }
+    buf += w;
+    len -= w;
+  }
+  return TRUE;
+}
+
+/* Write all of iov at offset. Modifies iov. */
+static gboolean
+write_at(int fd, struct iovec *iov, int iovcnt, guint64 offset, GError **err)
+{
+  while (iovcnt > 0) {
+    ssize_t w = pwritev(fd, iov, iovcnt, offset);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      g_set_error(err, DGW_ERROR, DGW_ERROR_WRITE,
+		  "Failed to write capture file: %s", g_strerror(errno));
+      return FALSE;
+    }
+    offset += w;
+    while (iovcnt > 0 && (gsize)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (guint8*)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return TRUE;
+}
+
+static gboolean
+read_at(int fd, guint8 *buf, gsize len, guint64 offset)
+{
+  while (len > 0) {
+    ssize_t r = pread(fd, buf, len, offset);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return FALSE;
+    buf += r;
+    len -= r;
+    offset += r;
+  }
+  return TRUE;
+}
+
+static gboolean
+sync_file(CaptureWriter *writer, gint64 now, GError **err)
+{
+  if (fdatasync(writer->fd) < 0) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_WRITE,
+		"Failed to sync capture file: %s", g_strerror(errno));
+    return FALSE;
+  }
+  writer->dirty = FALSE;
+  writer->synced = now;
+  return TRUE;
+}
+
+/* Make a new directory entry survive a crash */
+static void
+sync_dir(const gchar *path)
+{
+  gchar *dir = g_path_get_dirname(path);
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  g_free(dir);
+}
+
+static void
+close_file(CaptureWriter *writer)
+{
+  if (writer->fd >= 0) {
+    close(writer->fd);
+    writer->fd = -1;
+  }
+  if (writer->index_fd >= 0) {
+    close(writer->index_fd);
+    writer->index_fd = -1;
+  }
+}
+
+static gboolean
+finish_file(CaptureWriter *writer, GError **err)
+{
+  gboolean ok = TRUE;
+  if (writer->dirty) ok = sync_file(writer, writer->synced, err);
+  close_file(writer);
+  return ok;
+}
+
+/* Files are named after the time of their first record */
+static gboolean
+open_file(CaptureWriter *writer, gint64 time, GError **err)
+{
+  char stamp[32];
+  struct tm tm;
+  time_t secs = time / G_USEC_PER_SEC;
+  gchar *path;
+  gchar *index_path;
+  unsigned int n = 0;
+  struct iovec iov;
+  gmtime_r(&secs, &tm);
+  strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+  while(TRUE) {
+    if (n == 0) {
+      path = g_strdup_printf("%s-%s" CAPTURE_FILE_SUFFIX,
+			     writer->prefix, stamp);
+    } else {
+      path = g_strdup_printf("%s-%s-%d" CAPTURE_FILE_SUFFIX,
+			     writer->prefix, stamp, n);
+    }
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (writer->fd >= 0 || errno != EEXIST) break;
+    g_free(path);
+    n++;
+  }
+  if (writer->fd < 0) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_WRITE,
+		"Failed to create %s: %s", path, g_strerror(errno));
+    g_free(path);
+    return FALSE;
+  }
+  index_path = g_strdup_printf("%s" CAPTURE_INDEX_SUFFIX, path);
+  writer->index_fd = open(index_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer->index_fd < 0) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_WRITE,
+		"Failed to create %s: %s", index_path, g_strerror(errno));
+    g_free(index_path);
+    g_free(path);
+    close_file(writer);
+    return FALSE;
+  }
+  g_debug("Capturing to %s", path);
+  sync_dir(path);
+  g_free(index_path);
+  g_free(path);
+  iov.iov_base = (void*)CAPTURE_FILE_MAGIC;
+  iov.iov_len = CAPTURE_FILE_MAGIC_LEN;
+  if (!write_at(writer->fd, &iov, 1, 0, err)) {
+    close_file(writer);
+    return FALSE;
+  }
+  writer->offset = CAPTURE_FILE_MAGIC_LEN;
+  writer->opened = time;
+  writer->dirty = TRUE;
+  return TRUE;
+}
+
+typedef struct CaptureCandidate CaptureCandidate;
+struct CaptureCandidate
+{
+  gchar *path;
+  struct timespec mtime;
+};
+
+static gint
+compare_candidates(gconstpointer a, gconstpointer b)
+{
+  const CaptureCandidate *ca = a;
+  const CaptureCandidate *cb = b;
+  if (ca->mtime.tv_sec != cb->mtime.tv_sec) {
+    return ca->mtime.tv_sec < cb->mtime.tv_sec ? 1 : -1;
+  }
+  if (ca->mtime.tv_nsec != cb->mtime.tv_nsec) {
+    return ca->mtime.tv_nsec < cb->mtime.tv_nsec ? 1 : -1;
+  }
+  return -strcmp(ca->path, cb->path);
+}
+
+/* The capture files with this prefix, the one modified last first */
+static GPtrArray *
+capture_files(const gchar *prefix)
+{
+  gchar *dir_name = g_path_get_dirname(prefix);
+  gchar *base = g_path_get_basename(prefix);
+  gsize base_len = strlen(base);
+  GDir *dir = g_dir_open(dir_name, 0, NULL);
+  GArray *candidates = g_array_new(FALSE, FALSE, sizeof(CaptureCandidate));
+  GPtrArray *files = g_ptr_array_new_with_free_func(g_free);
+  const gchar *name;
+  guint i;
+  if (dir) {
+    while ((name = g_dir_read_name(dir))) {
+      CaptureCandidate c;
+      struct stat st;
+      if (strncmp(name, base, base_len) || name[base_len] != '-'
+	  || !g_ascii_isdigit(name[base_len + 1])
+	  || !g_str_has_suffix(name, CAPTURE_FILE_SUFFIX)) {
+	continue;
+      }
+      c.path = g_build_filename(dir_name, name, NULL);
+      if (stat(c.path, &st) == 0 && S_ISREG(st.st_mode)) {
+	c.mtime = st.st_mtim;
+	g_array_append_val(candidates, c);
+      } else {
+	g_free(c.path);
+      }
+    }
+    g_dir_close(dir);
+  }
+  g_array_sort(candidates, compare_candidates);
+  for (i = 0; i < candidates->len; i++) {
+    g_ptr_array_add(files, g_array_index(candidates, CaptureCandidate, i).path);
+  }
+  g_array_free(candidates, TRUE);
+  g_free(base);
+  g_free(dir_name);
+  return files;
+}
+
+/* Check the blocks of a version 2 capture file from the start, using buf
+   to read the payloads. Returns the offset after the last good block.
+   first_time is set from the first good block and next_seq from the
+   last one, and index gets an entry for each unless it is NULL. */
+static guint64
+scan_blocks(int fd, guint64 size, guint8 *buf, GByteArray *index,
+	    guint *n_blocks, gint64 *first_time, guint64 *next_seq)
+{
+  guint8 header[CAPTURE_BLOCK_HEADER_SIZE];
+  guint64 offset = CAPTURE_FILE_MAGIC_LEN;
+  *n_blocks = 0;
+  while (offset + CAPTURE_BLOCK_HEADER_SIZE <= size
+	 && read_at(fd, header, CAPTURE_BLOCK_HEADER_SIZE, offset)) {
+    guint32 n_records = get_u32(header + 4);
+    guint32 payload_len = get_u32(header + 24);
+    guint8 entry[CAPTURE_INDEX_ENTRY_SIZE];
+    guint8 *p;
+    if (get_u32(header) != CAPTURE_BLOCK_MAGIC
+	|| n_records == 0 || n_records > CAPTURE_BLOCK_RECORDS
+	|| payload_len > CAPTURE_BLOCK_RECORDS * CAPTURE_RECORD_MAX_SIZE
+	|| offset + CAPTURE_BLOCK_HEADER_SIZE + payload_len > size
+	|| !read_at(fd, buf, payload_len, offset + CAPTURE_BLOCK_HEADER_SIZE)
+	|| block_crc(header, buf, payload_len) != get_u32(header + 28)) {
+      break;
+    }
+    if ((*n_blocks)++ == 0) *first_time = get_u64(header + 8);
+    *next_seq = get_u64(header + 32) + n_records;
+    if (index) {
+      p = put_u64(entry, get_u64(header + 8));
+      p = put_u64(p, get_u64(header + 16));
+      p = put_u64(p, offset);
+      p = put_u32(p, n_records);
+      put_u32(p, payload_len);
+      g_byte_array_append(index, entry, sizeof(entry));
+    }
+    offset += CAPTURE_BLOCK_HEADER_SIZE + payload_len;
+  }
+  return offset;
+}
+
+/* Records of a block's payload as far as they are complete, the payload
+   of an open block may end in the middle of one. Returns the number of
+   records and sets the time of the last and the length they use. */
+static guint32
+scan_payload(const guint8 *payload, gsize len, gint64 time,
+	     gint64 *last_time, gsize *used)
+{
+  const guint8 *p = payload;
+  const guint8 *end = payload + len;
+  guint32 n = 0;
+  *last_time = time;
+  *used = 0;
+  while (n < CAPTURE_BLOCK_RECORDS) {
+    guint64 dt;
+    guint64 dflags;
+    guint64 frame;
+    if (!get_varint(&p, end, &dt) || !get_varint(&p, end, &dflags)
+	|| !get_varint(&p, end, &frame) || frame > G_MAXUINT16) {
+      break;
+    }
+    time += unzigzag(dt);
+    n++;
+    *last_time = time;
+    *used = p - payload;
+  }
+  return n;
+}
+
+/* A block that was still open when the writer went down has a header
+   without records, followed by the payload written so far. If there is
+   one at *offset, seal it with the complete records, using buf for the
+   payload, add an index entry and move *offset past it. found is set if
+   there was an open block, even one without records. */
+static gboolean
+seal_open_block(int fd, guint64 size, guint8 *buf, GByteArray *index,
+		guint64 *offset, guint *n_blocks, gint64 *first_time,
+		guint64 *next_seq, gboolean *found, GError **err)
+{
+  guint8 header[CAPTURE_BLOCK_HEADER_SIZE];
+  guint8 entry[CAPTURE_INDEX_ENTRY_SIZE];
+  struct iovec iov;
+  gint64 last_time;
+  guint32 n_records;
+  gsize len;
+  guint8 *p;
+  *found = FALSE;
+  if (*offset + CAPTURE_BLOCK_HEADER_SIZE > size
+      || !read_at(fd, header, CAPTURE_BLOCK_HEADER_SIZE, *offset)
+      || get_u32(header) != CAPTURE_BLOCK_MAGIC || get_u32(header + 4) != 0) {
+    return TRUE;
+  }
+  *found = TRUE;
+  *next_seq = get_u64(header + 32);
+  len = MIN(size - *offset - CAPTURE_BLOCK_HEADER_SIZE,
+	    CAPTURE_BLOCK_RECORDS * CAPTURE_RECORD_MAX_SIZE);
+  if (!read_at(fd, buf, len, *offset + CAPTURE_BLOCK_HEADER_SIZE)) {
+    return TRUE;
+  }
+  n_records = scan_payload(buf, len, get_u64(header + 8), &last_time, &len);
+  if (n_records == 0) return TRUE;
+  put_u32(header + 4, n_records);
+  put_u64(header + 16, last_time);
+  put_u32(header + 24, len);
+  put_u32(header + 28, block_crc(header, buf, len));
+  iov.iov_base = header;
+  iov.iov_len = sizeof(header);
+  if (!write_at(fd, &iov, 1, *offset, err)) return FALSE;
+  g_message("Sealed open block at offset %" G_GUINT64_FORMAT
+	    " with %u records", *offset, n_records);
+  if ((*n_blocks)++ == 0) *first_time = get_u64(header + 8);
+  *next_seq += n_records;
+  p = put_u64(entry, get_u64(header + 8));
+  p = put_u64(p, last_time);
+  p = put_u64(p, *offset);
+  p = put_u32(p, n_records);
+  put_u32(p, len);
+  g_byte_array_append(index, entry, sizeof(entry));
+  *offset += CAPTURE_BLOCK_HEADER_SIZE + len;
+  return TRUE;
+}
+
+static gboolean
+is_current_version(int fd)
+{
+  guint8 magic[CAPTURE_FILE_MAGIC_LEN];
+  return (read_at(fd, magic, CAPTURE_FILE_MAGIC_LEN, 0)
+	  && !memcmp(magic, CAPTURE_FILE_MAGIC, CAPTURE_FILE_MAGIC_LEN));
+}
+
+/* Sequence number after the last good block of the newest file that has
+   one, skipping files[0]. Stays 0 if an older version file comes
+   first. */
+static guint64
+previous_seq(CaptureWriter *writer, GPtrArray *files)
+{
+  guint64 next_seq = 0;
+  guint i;
+  for (i = 1; i < files->len; i++) {
+    const gchar *path = g_ptr_array_index(files, i);
+    struct stat st;
+    guint n_blocks = 0;
+    gint64 first_time;
+    gboolean current;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) continue;
+    current = fstat(fd, &st) == 0 && is_current_version(fd);
+    if (current) {
+      scan_blocks(fd, st.st_size, writer->payload, NULL, &n_blocks,
+		  &first_time, &next_seq);
+    }
+    close(fd);
+    if (!current || n_blocks > 0) break;
+  }
+  return next_seq;
+}
+
+/* Check the blocks of the newest capture file, seal the block that was
+   open when the writer went down with the records that made it to the
+   file, cut off anything after it and continue appending to the file.
+   The index file is rebuilt since it is never synced. If the crash came
+   before the first block of the file was written, the records are
+   numbered on from the previous file. */
+static gboolean
+recover_file(CaptureWriter *writer, GError **err)
+{
+  GPtrArray *files = capture_files(writer->prefix);
+  const gchar *path;
+  gchar *index_path;
+  GByteArray *index;
+  guint64 offset;
+  struct stat st;
+  guint n_blocks;
+  gboolean was_open;
+  gboolean ok;
+  int fd;
+  if (files->len == 0) {
+    g_ptr_array_free(files, TRUE);
+    return TRUE;
+  }
+  path = g_ptr_array_index(files, 0);
+  fd = open(path, O_RDWR);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_READ,
+		"Failed to open %s: %s", path, g_strerror(errno));
+    if (fd >= 0) close(fd);
+    g_ptr_array_free(files, TRUE);
+    return FALSE;
+  }
+  /* Files written by older versions are left alone */
+  if (!is_current_version(fd)) {
+    close(fd);
+    g_ptr_array_free(files, TRUE);
+    return TRUE;
+  }
+  index = g_byte_array_new();
+  writer->opened = st.st_mtim.tv_sec * G_USEC_PER_SEC;
+  offset = scan_blocks(fd, st.st_size, writer->payload, index, &n_blocks,
+		       &writer->opened, &writer->next_seq);
+  if (!seal_open_block(fd, st.st_size, writer->payload, index, &offset,
+		       &n_blocks, &writer->opened, &writer->next_seq,
+		       &was_open, err)) {
+    g_byte_array_free(index, TRUE);
+    close(fd);
+    g_ptr_array_free(files, TRUE);
+    return FALSE;
+  }
+  if (n_blocks == 0 && !was_open) {
+    writer->next_seq = previous_seq(writer, files);
+  }
+  if (offset < (guint64)st.st_size) {
+    g_warning("Truncating torn block at offset %" G_GUINT64_FORMAT
+	      " of %s (%" G_GUINT64_FORMAT " bytes lost)",
+	      offset, path, (guint64)st.st_size - offset);
+    if (ftruncate(fd, offset) < 0 || fdatasync(fd) < 0) {
+      g_set_error(err, DGW_ERROR, DGW_ERROR_WRITE,
+		  "Failed to truncate %s: %s", path, g_strerror(errno));
+      g_byte_array_free(index, TRUE);
+      close(fd);
+      g_ptr_array_free(files, TRUE);
+      return FALSE;
+    }
+  }
+  index_path = g_strdup_printf("%s" CAPTURE_INDEX_SUFFIX, path);
+  writer->fd = fd;
+  writer->index_fd = open(index_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer->index_fd < 0) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_WRITE,
+		"Failed to create %s: %s", index_path, g_strerror(errno));
+    ok = FALSE;
+  } else {
+    ok = write_all(writer->index_fd, index->data, index->len, err);
+  }
+  if (ok) {
+    g_message("Resuming %s at record %" G_GUINT64_FORMAT,
+	      path, writer->next_seq);
+  }
+  g_byte_array_free(index, TRUE);
+  g_free(index_path);
+  g_ptr_array_free(files, TRUE);
+  if (!ok) {
+    close_file(writer);
+    return FALSE;
+  }
+  writer->offset = offset;
+  writer->synced = g_get_real_time();
+  if (writer->max_size > 0 && writer->offset >= writer->max_size) {
+    close_file(writer);
+  }
+  return TRUE;
+}
+
+CaptureWriter *
+capture_writer_new(const gchar *prefix, guint64 max_size, gint64 max_age,
+		   GError **err)
+{
+  CaptureWriter *writer = g_new(CaptureWriter, 1);
+  writer->prefix = g_strdup(prefix);
+  writer->max_size = max_size;
+  writer->max_age = max_age;
+  writer->commit_interval = CAPTURE_COMMIT_INTERVAL;
+  writer->sync_interval = CAPTURE_SYNC_INTERVAL;
+  writer->fd = -1;
+  writer->index_fd = -1;
+  writer->offset = 0;
+  writer->opened = 0;
+  writer->dirty = FALSE;
+  writer->synced = 0;
+  writer->next_seq = 0;
+  writer->payload_len = 0;
+  writer->block_open = FALSE;
+  writer->written = 0;
+  writer->uncommitted = 0;
+  writer->n_records = 0;
+  if (!recover_file(writer, err)) {
+    capture_writer_free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+/* New records are appended to the open block in the file when
+   commit_interval has passed since the first of them, and the file is
+   synced when sync_interval has passed since the last sync. Records are
+   lost in a crash for at most the sum of both. */
+void
+capture_writer_set_intervals(CaptureWriter *writer, gint64 commit_interval,
+			     gint64 sync_interval)
+{
+  writer->commit_interval = commit_interval;
+  writer->sync_interval = sync_interval;
+}
+
+static void
+drop_block(CaptureWriter *writer)
+{
+  writer->n_records = 0;
+  writer->block_open = FALSE;
+  writer->written = 0;
+}
+
+/* Append the records that are not in the file yet to the open block,
+   writing a header without records first if the block is new. Readers
+   stop at such a block, recovery seals it. */
+static gboolean
+write_records(CaptureWriter *writer, GError **err)
+{
+  guint8 header[CAPTURE_BLOCK_HEADER_SIZE];
+  struct iovec iov[2];
+  guint64 offset = writer->offset;
+  int n = 0;
+  guint8 *p;
+  if (writer->written == writer->payload_len) return TRUE;
+  if (writer->block_open) {
+    offset += CAPTURE_BLOCK_HEADER_SIZE + writer->written;
+  } else {
+    memset(header, 0, sizeof(header));
+    p = put_u32(header, CAPTURE_BLOCK_MAGIC);
+    p = put_u32(p, 0);
+    put_u64(p, writer->first_time);
+    put_u64(header + 32, writer->next_seq);
+    iov[n].iov_base = header;
+    iov[n++].iov_len = sizeof(header);
+  }
+  iov[n].iov_base = writer->payload + writer->written;
+  iov[n++].iov_len = writer->payload_len - writer->written;
+  if (!write_at(writer->fd, iov, n, offset, err)) {
+    drop_block(writer);
+    close_file(writer);
+    return FALSE;
+  }
+  writer->block_open = TRUE;
+  writer->written = writer->payload_len;
+  writer->dirty = TRUE;
+  return TRUE;
+}
+
+/* Write the rest of the current block and seal it with its header and
+   an index entry */
+gboolean
+capture_writer_flush(CaptureWriter *writer, GError **err)
+{
+  guint8 header[CAPTURE_BLOCK_HEADER_SIZE];
+  guint8 entry[CAPTURE_INDEX_ENTRY_SIZE];
+  struct iovec iov;
+  guint8 *p;
+  if (writer->n_records == 0) return TRUE;
+  if (!write_records(writer, err)) return FALSE;
+  p = put_u32(header, CAPTURE_BLOCK_MAGIC);
+  p = put_u32(p, writer->n_records);
+  p = put_u64(p, writer->first_time);
+  p = put_u64(p, writer->prev_time);
+  p = put_u32(p, writer->payload_len);
+  put_u64(p + 4, writer->next_seq);
+  put_u32(p, block_crc(header, writer->payload, writer->payload_len));
+  p = put_u64(entry, writer->first_time);
+  p = put_u64(p, writer->prev_time);
+  p = put_u64(p, writer->offset);
+  p = put_u32(p, writer->n_records);
+  put_u32(p, writer->payload_len);
+  writer->next_seq += writer->n_records;
+  drop_block(writer);
+  iov.iov_base = header;
+  iov.iov_len = sizeof(header);
+  if (!write_at(writer->fd, &iov, 1, writer->offset, err)
+      || !write_all(writer->index_fd, entry, sizeof(entry), err)) {
+    close_file(writer);
+    return FALSE;
+  }
+  writer->offset += sizeof(header) + writer->payload_len;
+  if (writer->max_size > 0 && writer->offset >= writer->max_size) {
+    return finish_file(writer, err);
+  }
+  return TRUE;
+}
+
+/* Called regularly, e.g. after every poll, with the current time. A
+   block is sealed when it is CAPTURE_BLOCK_MAX_AGE old even if no more
+   records come. */
+gboolean
+capture_writer_commit(CaptureWriter *writer, gint64 now, GError **err)
+{
+  if (writer->n_records > 0
+      && now - writer->first_time >= CAPTURE_BLOCK_MAX_AGE) {
+    if (!capture_writer_flush(writer, err)) return FALSE;
+  } else if (writer->written < writer->payload_len
+	     && now - writer->uncommitted >= writer->commit_interval) {
+    if (!write_records(writer, err)) return FALSE;
+  }
+  if (writer->fd >= 0 && writer->dirty
+      && now - writer->synced >= writer->sync_interval) {
+    return sync_file(writer, now, err);
+  }
+  return TRUE;
+}
+
+gboolean
+capture_writer_add(CaptureWriter *writer, gint64 time, const uint16_t *rec,
+		   GError **err)
+{
+  guint8 *p;
+  if (writer->fd >= 0 && writer->max_age > 0
+      && time - writer->opened >= writer->max_age) {
+    if (!capture_writer_flush(writer, err)) return FALSE;
+    if (!finish_file(writer, err)) return FALSE;
+  }
+  if (writer->n_records > 0
+      && (writer->n_records == CAPTURE_BLOCK_RECORDS
+	  || time - writer->first_time >= CAPTURE_BLOCK_MAX_AGE)) {
+    if (!capture_writer_flush(writer, err)) return FALSE;
+  }
+  if (writer->fd < 0) {
+    if (!open_file(writer, time, err)) return FALSE;
+  }
+  if (writer->n_records == 0) {
+    writer->first_time = time;
+    writer->prev_time = time;
+    writer->prev_flags = 0;
+    writer->payload_len = 0;
+  }
+  if (writer->written == writer->payload_len) writer->uncommitted = time;
+  p = writer->payload + writer->payload_len;
+  p = put_varint(p, zigzag(time - writer->prev_time));
+  p = put_varint(p, zigzag((gint64)rec[1] - writer->prev_flags));
+  p = put_varint(p, rec[0]);
+  writer->payload_len = p - writer->payload;
+  writer->prev_time = time;
+  writer->prev_flags = rec[1];
+  writer->n_records++;
+  return TRUE;
+}
+
+void
+capture_writer_free(CaptureWriter *writer)
+{
+  GError *err = NULL;
+  if (!writer) return;
+  if (writer->fd >= 0 && (!capture_writer_flush(writer, &err)
+			  || (writer->fd >= 0
+			      && !finish_file(writer, &err)))) {
+    g_printerr("%s\n", err->message);
+    g_clear_error(&err);
+  }
+  close_file(writer);
+  g_free(writer->prefix);
+  g_free(writer);
+}
+
+static gboolean
+parse_block_header(const CaptureFile *file, guint64 offset,
+		   CaptureBlockInfo *info)
+{
+  const guint8 *p = file->data + offset;
+  if (offset + file->header_size > file->len
+      || get_u32(p) != CAPTURE_BLOCK_MAGIC) {
+    return FALSE;
+  }
+  info->offset = offset;
+  info->n_records = get_u32(p + 4);
+  info->first_time = get_u64(p + 8);
+  info->last_time = get_u64(p + 16);
+  info->payload_len = get_u32(p + 24);
+  info->crc = get_u32(p + 28);
+  info->first_seq = file->checksum ? get_u64(p + 32) : 0;
+  /* A block without records is still open */
+  if (info->n_records == 0 || info->n_records > CAPTURE_BLOCK_RECORDS) {
+    return FALSE;
+  }
+  return offset + file->header_size + info->payload_len <= file->len;
+}
+
+/* Use the index file as far as it agrees with the capture file and scan
+   the block headers for the rest */
+static void
+load_index(CaptureFile *file, const gchar *path)
+{
+  gchar *index_path = g_strdup_printf("%s" CAPTURE_INDEX_SUFFIX, path);
+  gchar *index;
+  gsize index_len;
+  guint64 offset = CAPTURE_FILE_MAGIC_LEN;
+  CaptureBlockInfo info;
+  if (g_file_get_contents(index_path, &index, &index_len, NULL)) {
+    const guint8 *p = (const guint8*)index;
+    const guint8 *end = p + index_len;
+    for (; p + CAPTURE_INDEX_ENTRY_SIZE <= end;
+	 p += CAPTURE_INDEX_ENTRY_SIZE) {
+      if (get_u64(p + 16) != offset
+	  || !parse_block_header(file, offset, &info)
+	  || info.first_time != (gint64)get_u64(p)) {
+	break;
+      }
+      g_array_append_val(file->blocks, info);
+      offset += file->header_size + info.payload_len;
+    }
+    g_free(index);
+  }
+  g_free(index_path);
+  while (parse_block_header(file, offset, &info)) {
+    g_array_append_val(file->blocks, info);
+    offset += file->header_size + info.payload_len;
+  }
+}
+
+CaptureFile *
+capture_file_open(const gchar *path, GError **err)
+{
+  CaptureFile *file;
+  GMappedFile *map = g_mapped_file_new(path, FALSE, err);
+  if (!map) return NULL;
+  file = g_new(CaptureFile, 1);
+  file->map = map;
+  file->data = (const guint8*)g_mapped_file_get_contents(map);
+  file->len = g_mapped_file_get_length(map);
+  file->blocks = g_array_new(FALSE, FALSE, sizeof(CaptureBlockInfo));
+  file->header_size = CAPTURE_BLOCK_HEADER_SIZE;
+  file->checksum = TRUE;
+  if (file->len >= CAPTURE_FILE_MAGIC_LEN
+      && !memcmp(file->data, CAPTURE_FILE_MAGIC_V1, CAPTURE_FILE_MAGIC_LEN)) {
+    file->header_size = CAPTURE_BLOCK_HEADER_SIZE_V1;
+    file->checksum = FALSE;
+  } else if (file->len < CAPTURE_FILE_MAGIC_LEN
+	     || memcmp(file->data, CAPTURE_FILE_MAGIC,
+		       CAPTURE_FILE_MAGIC_LEN)) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_READ,
+		"%s is not a capture file", path);
+    capture_file_close(file);
+    return NULL;
+  }
+  load_index(file, path);
+  return file;
+}
+
+void
+capture_file_close(CaptureFile *file)
+{
+  if (!file) return;
+  g_array_free(file->blocks, TRUE);
+  g_mapped_file_unref(file->map);
+  g_free(file);
+}
+
+/* Index of the first block that may contain records at or after time,
+   the number of blocks if there is none. */
+guint
+capture_file_find(const CaptureFile *file, gint64 time)
+{
+  guint low = 0;
+  guint high = file->blocks->len;
+  while (low < high) {
+    guint mid = (low + high) / 2;
+    if (g_array_index(file->blocks, CaptureBlockInfo, mid).last_time < time) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/* Decode all records of a block. records must have room for n_records
+   entries. */
+gboolean
+capture_file_decode(const CaptureFile *file, guint block,
+		    CaptureRecord *records, GError **err)
+{
+  const CaptureBlockInfo *info =
+    &g_array_index(file->blocks, CaptureBlockInfo, block);
+  const guint8 *p = file->data + info->offset + file->header_size;
+  const guint8 *end = p + info->payload_len;
+  gint64 time = info->first_time;
+  gint64 flags = 0;
+  guint32 i;
+  if (file->checksum
+      && block_crc(file->data + info->offset, p, info->payload_len)
+      != info->crc) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_READ,
+		"Bad checksum in block at offset %" G_GUINT64_FORMAT,
+		info->offset);
+    return FALSE;
+  }
+  for (i = 0; i < info->n_records; i++) {
+    guint64 dt;
+    guint64 dflags;
+    guint64 frame;
+    if (!get_varint(&p, end, &dt) || !get_varint(&p, end, &dflags)
+	|| !get_varint(&p, end, &frame)) {
+      g_set_error(err, DGW_ERROR, DGW_ERROR_READ,
+		  "Truncated block at offset %" G_GUINT64_FORMAT,
+		  info->offset);
+      return FALSE;
+    }
+    time += unzigzag(dt);
+    flags += unzigzag(dflags);
+    records[i].time = time;
+    records[i].rec[0] = frame;
+    records[i].rec[1] = flags;
+  }
+  return TRUE;
+}
@@ -0,0 +1,114 @@
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+#include <glib.h>
+
+/* Capture files start with CAPTURE_FILE_MAGIC followed by blocks. Each
+   block is a CAPTURE_BLOCK_HEADER_SIZE byte header and a payload of
+   delta encoded records. Blocks are decoded independently of each other.
+   Every capture file has an index file next to it (name + ".idx") with
+   one CAPTURE_INDEX_ENTRY_SIZE byte entry per block. All integers are
+   little endian.
+
+   Version 2 block headers also hold a CRC-32 of the header and payload
+   and the sequence number of the first record, counted across files and
+   restarts. A block with a bad checksum ends the file, it was torn by a
+   crash. A block whose header has no records is still open, records are
+   appended to its payload as they are committed and the header is only
+   filled in when the block is complete. Readers stop at it, the writer
+   seals it on restart. Version 1 files can still be read. */
+
+#define CAPTURE_FILE_MAGIC "DGWCAP2\n"
+#define CAPTURE_FILE_MAGIC_V1 "DGWCAP1\n"
+#define CAPTURE_FILE_MAGIC_LEN 8
+#define CAPTURE_FILE_SUFFIX ".dgwcap"
+#define CAPTURE_INDEX_SUFFIX ".idx"
+
+#define CAPTURE_BLOCK_MAGIC 0x4b4c4247
+#define CAPTURE_BLOCK_HEADER_SIZE 40
+#define CAPTURE_BLOCK_HEADER_SIZE_V1 32
+#define CAPTURE_INDEX_ENTRY_SIZE 32
+
+/* Flush a block when it has this many records */
+#define CAPTURE_BLOCK_RECORDS 1024
+/* or when the first record is this old (us) */
+#define CAPTURE_BLOCK_MAX_AGE (60 * G_USEC_PER_SEC)
+
+/* Default time between commits of new records to the open block (us) */
+#define CAPTURE_COMMIT_INTERVAL G_USEC_PER_SEC
+/* Default time between fdatasync calls (us) */
+#define CAPTURE_SYNC_INTERVAL (5 * G_USEC_PER_SEC)
+
+/* Worst case encoded size of one record */
+#define CAPTURE_RECORD_MAX_SIZE (10 + 3 + 3)
+
+typedef struct CaptureRecord CaptureRecord;
+struct CaptureRecord
+{
+  gint64 time; /* us since the epoch */
+  uint16_t rec[2];
+};
+
+typedef struct CaptureBlockInfo CaptureBlockInfo;
+struct CaptureBlockInfo
+{
+  gint64 first_time;
+  gint64 last_time;
+  guint64 offset;
+  guint64 first_seq; /* 0 in version 1 files */
+  guint32 n_records;
+  guint32 payload_len;
+  guint32 crc;
+};
+
+typedef struct CaptureWriter CaptureWriter;
+
+CaptureWriter *
+capture_writer_new(const gchar *prefix, guint64 max_size, gint64 max_age,
+		   GError **err);
+
+gboolean
+capture_writer_add(CaptureWriter *writer, gint64 time, const uint16_t *rec,
+		   GError **err);
+
+void
+capture_writer_set_intervals(CaptureWriter *writer, gint64 commit_interval,
+			     gint64 sync_interval);
+
+gboolean
+capture_writer_commit(CaptureWriter *writer, gint64 now, GError **err);
+
+gboolean
+capture_writer_flush(CaptureWriter *writer, GError **err);
+
+void
+capture_writer_free(CaptureWriter *writer);
+
+/* Read access to a capture file. Decoding only reads the mapped file, so
+   blocks may be decoded from several threads at once. */
+typedef struct CaptureFile CaptureFile;
+struct CaptureFile
+{
+  GMappedFile *map;
+  const guint8 *data;
+  gsize len;
+  guint header_size;
+  gboolean checksum;
+  GArray *blocks; /* CaptureBlockInfo */
+};
+
+CaptureFile *
+capture_file_open(const gchar *path, GError **err);
+
+void
+capture_file_close(CaptureFile *file);
+
+guint
+capture_file_find(const CaptureFile *file, gint64 time);
+
+gboolean
+capture_file_decode(const CaptureFile *file, guint block,
+		    CaptureRecord *records, GError **err);
+
+#endif /* __CAPTURE_H__ */
@@ -0,0 +1,186 @@
+#include "control.h"
+#include "dgw_error.h"
+#include <glib-unix.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/* Longer lines close the connection */
+#define CONTROL_LINE_MAX 4096
+
+struct ControlServer
+{
+  gchar *path;
+  int fd;
+  guint watch;
+  GList *clients;
+  ControlLineFunc func;
+  gpointer user_data;
+};
+
+struct ControlClient
+{
+  ControlServer *server; /* NULL when closed */
+  int fd;
+  guint watch;
+  GString *input;
+  guint refcount;
+};
+
+ControlClient *
+control_client_ref(ControlClient *client)
+{
+  client->refcount++;
+  return client;
+}
+
+void
+control_client_unref(ControlClient *client)
+{
+  if (--client->refcount > 0) return;
+  g_string_free(client->input, TRUE);
+  g_free(client);
+}
+
+static void
+client_close(ControlClient *client)
+{
+  ControlServer *server = client->server;
+  if (!server) return;
+  server->clients = g_list_remove(server->clients, client);
+  client->server = NULL;
+  g_source_remove(client->watch);
+  close(client->fd);
+  client->fd = -1;
+  control_client_unref(client);
+}
+
+void
+control_client_reply(ControlClient *client, const gchar *text)
+{
+  gsize len = strlen(text);
+  while (client->server && len > 0) {
+    ssize_t w = send(client->fd, text, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      /* A client that doesn't read its replies is dropped */
+      client_close(client);
+      return;
+    }
+    text += w;
+    len -= w;
+  }
+}
+
+static gboolean
+client_input(gint fd, GIOCondition condition, gpointer user_data)
+{
+  ControlClient *client = user_data;
+  gchar buffer[1024];
+  gchar *nl;
+  gboolean open;
+  ssize_t r = read(fd, buffer, sizeof(buffer));
+  if (r < 0 && (errno == EINTR || errno == EAGAIN)) return TRUE;
+  if (r <= 0) {
+    client_close(client);
+    return FALSE;
+  }
+  g_string_append_len(client->input, buffer, r);
+  control_client_ref(client);
+  while (client->server && (nl = memchr(client->input->str, '\n',
+					client->input->len))) {
+    *nl = '\0';
+    if (nl > client->input->str && nl[-1] == '\r') nl[-1] = '\0';
+    client->server->func(client, client->input->str,
+			 client->server->user_data);
+    g_string_erase(client->input, 0, nl - client->input->str + 1);
+  }
+  if (client->input->len > CONTROL_LINE_MAX) {
+    client_close(client);
+  }
+  open = client->server != NULL;
+  control_client_unref(client);
+  return open;
+}
+
+static gboolean
+server_accept(gint fd, GIOCondition condition, gpointer user_data)
+{
+  ControlServer *server = user_data;
+  ControlClient *client;
+  int cfd = accept(fd, NULL, NULL);
+  if (cfd < 0) return TRUE;
+  fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+  fcntl(cfd, F_SETFD, FD_CLOEXEC);
+  client = g_new(ControlClient, 1);
+  client->server = server;
+  client->fd = cfd;
+  client->input = g_string_new("");
+  client->refcount = 1;
+  client->watch = g_unix_fd_add(cfd, G_IO_IN | G_IO_HUP | G_IO_ERR,
+				client_input, client);
+  server->clients = g_list_prepend(server->clients, client);
+  return TRUE;
+}
+
+ControlServer *
+control_server_new(const gchar *path, ControlLineFunc func,
+		   gpointer user_data, GError **err)
+{
+  ControlServer *server;
+  struct sockaddr_un addr;
+  struct stat st;
+  int fd;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		"Control socket path too long");
+    return NULL;
+  }
+  /* Remove a socket left behind by an earlier run, but nothing else */
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		"Failed to create control socket: %s", g_strerror(errno));
+    return NULL;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+      || listen(fd, 4) < 0) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		"Failed to bind control socket %s: %s", path,
+		g_strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  server = g_new(ControlServer, 1);
+  server->path = g_strdup(path);
+  server->fd = fd;
+  server->clients = NULL;
+  server->func = func;
+  server->user_data = user_data;
+  server->watch = g_unix_fd_add(fd, G_IO_IN, server_accept, server);
+  return server;
+}
+
+void
+control_server_free(ControlServer *server)
+{
+  if (!server) return;
+  while (server->clients) {
+    client_close(server->clients->data);
+  }
+  g_source_remove(server->watch);
+  close(server->fd);
+  unlink(server->path);
+  g_free(server->path);
+  g_free(server);
+}
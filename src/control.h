@@ -0,0 +1,34 @@
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+
+#include <glib.h>
+
+/* Line based request/reply server on a Unix domain stream socket. All
+   functions must be called from the thread running the default main
+   context. */
+
+typedef struct ControlServer ControlServer;
+typedef struct ControlClient ControlClient;
+
+/* Called for every complete line received, without the newline */
+typedef void (*ControlLineFunc)(ControlClient *client, const gchar *line,
+				gpointer user_data);
+
+ControlServer *
+control_server_new(const gchar *path, ControlLineFunc func,
+		   gpointer user_data, GError **err);
+
+void
+control_server_free(ControlServer *server);
+
+ControlClient *
+control_client_ref(ControlClient *client);
+
+void
+control_client_unref(ControlClient *client);
+
+/* Send text to the client. Silently dropped if the client has gone away. */
+void
+control_client_reply(ControlClient *client, const gchar *text);
+
+#endif /* __CONTROL_H__ */
@@ -0,0 +1,409 @@
+#include "dali_cmd.h"
+#include "dgw_error.h"
+#include <stdlib.h>
+#include <string.h>
+
+DaliBatch *
+dali_batch_new(void)
+{
+  DaliBatch *batch = g_new(DaliBatch, 1);
+  batch->frames = g_array_new(FALSE, FALSE, sizeof(uint16_t));
+  batch->replies = g_array_new(FALSE, TRUE, sizeof(uint16_t));
+  batch->results = g_array_new(FALSE, TRUE, sizeof(DaliResult));
+  batch->blocks = g_array_new(FALSE, FALSE, sizeof(guint));
+  return batch;
+}
+
+void
+dali_batch_free(DaliBatch *batch)
+{
+  if (!batch) return;
+  g_array_free(batch->frames, TRUE);
+  g_array_free(batch->replies, TRUE);
+  g_array_free(batch->results, TRUE);
+  g_array_free(batch->blocks, TRUE);
+  g_free(batch);
+}
+
+void
+dali_batch_clear(DaliBatch *batch)
+{
+  g_array_set_size(batch->frames, 0);
+  g_array_set_size(batch->replies, 0);
+  g_array_set_size(batch->results, 0);
+  g_array_set_size(batch->blocks, 0);
+}
+
+/* Append frames that must end up in the same command queue block.
+   Frames are never reordered, so filling each block as far as the next
+   group allows gives the minimum number of blocks. */
+static void
+append_group(DaliBatch *batch, const DaliResult *res, guint n)
+{
+  guint *last = NULL;
+  guint i;
+  if (batch->blocks->len > 0) {
+    last = &g_array_index(batch->blocks, guint, batch->blocks->len - 1);
+  }
+  if (!last || *last + n > DALI_BLOCK_MAX) {
+    guint zero = 0;
+    g_array_append_val(batch->blocks, zero);
+    last = &g_array_index(batch->blocks, guint, batch->blocks->len - 1);
+  }
+  for (i = 0; i < n; i++) {
+    g_array_append_val(batch->frames, res[i].frame);
+    g_array_append_val(batch->results, res[i]);
+  }
+  g_array_set_size(batch->replies, batch->frames->len);
+  *last += n;
+}
+
+gboolean
+dali_frame_is_query(uint16_t frame)
+{
+  guint8 a = frame >> 8;
+  guint8 c = frame & 0xff;
+  if (!(a & 0x01)) return FALSE;
+  if (a < 0xa0 || a >= 0xfe) {
+    return (c >= 0x90 && c <= 0xc5) || c >= 0xe0;
+  }
+  /* COMPARE, VERIFY SHORT ADDRESS and QUERY SHORT ADDRESS */
+  return a == 0xa9 || a == 0xb9 || a == 0xbb;
+}
+
+gboolean
+dali_frame_is_send_twice(uint16_t frame)
+{
+  guint8 a = frame >> 8;
+  guint8 c = frame & 0xff;
+  if (!(a & 0x01)) return FALSE;
+  if (a < 0xa0 || a >= 0xfe) {
+    /* RESET to ENABLE WRITE MEMORY */
+    return c >= 0x20 && c <= 0x81;
+  }
+  /* INITIALISE and RANDOMISE */
+  return a == 0xa5 || a == 0xa7;
+}
+
+static uint16_t
+address_byte(DaliTargetType target_type, guint addr, gboolean cmd)
+{
+  switch(target_type) {
+  case DALI_TARGET_SHORT:
+    return (addr << 1) | cmd;
+  case DALI_TARGET_GROUP:
+    return 0x80 | (addr << 1) | cmd;
+  case DALI_TARGET_BROADCAST:
+  default:
+    return 0xfe | cmd;
+  }
+}
+
+gboolean
+dali_batch_add(DaliBatch *batch, DaliOp op, DaliTargetType target_type,
+	       guint addr, guint arg, GError **err)
+{
+  DaliResult res[2];
+  guint8 cmd;
+  memset(res, 0, sizeof(res));
+  if ((target_type == DALI_TARGET_SHORT && addr >= DALI_SHORT_ADDR_COUNT)
+      || (target_type == DALI_TARGET_GROUP && addr >= DALI_GROUP_COUNT)) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		"DALI address out of range");
+    return FALSE;
+  }
+  switch(op) {
+  case DALI_OP_ARC:
+    if (arg > 254) {
+      g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		  "Arc level must be 0-254");
+      return FALSE;
+    }
+    res[0].frame = (address_byte(target_type, addr, FALSE) << 8) | arg;
+    break;
+  case DALI_OP_OFF:
+    cmd = DALI_CMD_OFF;
+    goto command;
+  case DALI_OP_MAX:
+    cmd = DALI_CMD_RECALL_MAX;
+    goto command;
+  case DALI_OP_MIN:
+    cmd = DALI_CMD_RECALL_MIN;
+    goto command;
+  case DALI_OP_SCENE:
+    if (arg > 15) {
+      g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		  "Scene must be 0-15");
+      return FALSE;
+    }
+    cmd = DALI_CMD_GO_TO_SCENE + arg;
+    goto command;
+  case DALI_OP_RESET:
+    cmd = DALI_CMD_RESET;
+    goto command;
+  case DALI_OP_QUERY_STATUS:
+    cmd = DALI_CMD_QUERY_STATUS;
+    goto command;
+  case DALI_OP_QUERY_PRESENT:
+    cmd = DALI_CMD_QUERY_GEAR;
+    goto command;
+  case DALI_OP_QUERY_TYPE:
+    cmd = DALI_CMD_QUERY_DEVICE_TYPE;
+    goto command;
+  case DALI_OP_QUERY_LEVEL:
+    cmd = DALI_CMD_QUERY_ACTUAL_LEVEL;
+  command:
+    res[0].frame = (address_byte(target_type, addr, TRUE) << 8) | cmd;
+    break;
+  default:
+    g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		"Unsupported DALI operation");
+    return FALSE;
+  }
+  res[0].op = op;
+  res[0].target_type = target_type;
+  res[0].addr = addr;
+  res[0].arg = arg;
+  if (dali_frame_is_send_twice(res[0].frame)) {
+    res[1] = res[0];
+    res[1].repeat = TRUE;
+    append_group(batch, res, 2);
+  } else {
+    append_group(batch, res, 1);
+  }
+  return TRUE;
+}
+
+/* Raw send-twice commands are given twice by the caller. The second
+   frame of a pair is appended together with the first so they are never
+   split across blocks. */
+gboolean
+dali_batch_add_raw(DaliBatch *batch, uint16_t frame)
+{
+  DaliResult res[2];
+  guint n = batch->results->len;
+  memset(res, 0, sizeof(res));
+  res[0].op = DALI_OP_RAW;
+  res[0].frame = frame;
+  if (n > 0 && dali_frame_is_send_twice(frame)) {
+    const DaliResult *prev = &g_array_index(batch->results, DaliResult, n - 1);
+    if (prev->op == DALI_OP_RAW && !prev->repeat && prev->frame == frame) {
+      guint *last = &g_array_index(batch->blocks, guint,
+				   batch->blocks->len - 1);
+      if (--*last == 0) {
+	g_array_set_size(batch->blocks, batch->blocks->len - 1);
+      }
+      g_array_set_size(batch->frames, n - 1);
+      g_array_set_size(batch->results, n - 1);
+      res[1] = res[0];
+      res[1].repeat = TRUE;
+      append_group(batch, res, 2);
+      return TRUE;
+    }
+  }
+  append_group(batch, res, 1);
+  return TRUE;
+}
+
+static const struct {
+  const gchar *name;
+  DaliOp op;
+  gboolean has_arg;
+} op_names[] = {
+  {"arc", DALI_OP_ARC, TRUE},
+  {"off", DALI_OP_OFF, FALSE},
+  {"max", DALI_OP_MAX, FALSE},
+  {"min", DALI_OP_MIN, FALSE},
+  {"scene", DALI_OP_SCENE, TRUE},
+  {"reset", DALI_OP_RESET, FALSE},
+  {"status", DALI_OP_QUERY_STATUS, FALSE},
+  {"present", DALI_OP_QUERY_PRESENT, FALSE},
+  {"type", DALI_OP_QUERY_TYPE, FALSE},
+  {"level", DALI_OP_QUERY_LEVEL, FALSE}
+};
+
+const gchar *
+dali_op_name(DaliOp op)
+{
+  unsigned int i;
+  for (i = 0; i < G_N_ELEMENTS(op_names); i++) {
+    if (op_names[i].op == op) return op_names[i].name;
+  }
+  return "raw";
+}
+
+static gboolean
+parse_uint(const gchar *str, guint max, guint *value)
+{
+  char *end;
+  unsigned long v = strtoul(str, &end, 10);
+  if (end == str || *end != '\0' || v > max) return FALSE;
+  *value = v;
+  return TRUE;
+}
+
+/* Parse a command line operation.
+
+   A plain hex number is sent as a raw frame. Other operations are written
+   as OP:TARGET[:ARG] where TARGET is a short address (0-63), a range of
+   short addresses (A-B), "all" for every short address, gN for a group
+   or "bc" for broadcast. */
+gboolean
+dali_batch_parse(DaliBatch *batch, const gchar *spec, GError **err)
+{
+  gchar **parts;
+  const gchar *target;
+  DaliTargetType target_type;
+  guint first;
+  guint last;
+  guint arg = 0;
+  guint p;
+  guint a;
+  if (!strchr(spec, ':')) {
+    char *end;
+    unsigned long frame = strtoul(spec, &end, 16);
+    if (end == spec || *end != '\0' || frame > 0xffff) {
+      g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		  "Invalid command %s", spec);
+      return FALSE;
+    }
+    return dali_batch_add_raw(batch, frame);
+  }
+  parts = g_strsplit(spec, ":", 3);
+  for (p = 0; p < G_N_ELEMENTS(op_names); p++) {
+    if (strcmp(parts[0], op_names[p].name) == 0) break;
+  }
+  if (p == G_N_ELEMENTS(op_names)) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		"Unknown operation %s", parts[0]);
+    goto error;
+  }
+  if ((parts[2] != NULL) != op_names[p].has_arg) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		op_names[p].has_arg ? "Operation %s needs an argument"
+		: "Operation %s takes no argument", parts[0]);
+    goto error;
+  }
+  if (parts[2] && !parse_uint(parts[2], 254, &arg)) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		"Invalid argument in %s", spec);
+    goto error;
+  }
+  target = parts[1];
+  target_type = DALI_TARGET_SHORT;
+  if (strcmp(target, "bc") == 0) {
+    target_type = DALI_TARGET_BROADCAST;
+    first = last = 0;
+  } else if (strcmp(target, "all") == 0) {
+    first = 0;
+    last = DALI_SHORT_ADDR_COUNT - 1;
+  } else if (target[0] == 'g') {
+    target_type = DALI_TARGET_GROUP;
+    if (!parse_uint(target + 1, DALI_GROUP_COUNT - 1, &first)) {
+      g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		  "Invalid group in %s", spec);
+      goto error;
+    }
+    last = first;
+  } else {
+    gchar **range = g_strsplit(target, "-", 2);
+    gboolean ok = parse_uint(range[0], DALI_SHORT_ADDR_COUNT - 1, &first);
+    last = first;
+    if (ok && range[1]) {
+      ok = parse_uint(range[1], DALI_SHORT_ADDR_COUNT - 1, &last)
+	&& last >= first;
+    }
+    g_strfreev(range);
+    if (!ok) {
+      g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		  "Invalid address in %s", spec);
+      goto error;
+    }
+  }
+  for (a = first; a <= last; a++) {
+    if (!dali_batch_add(batch, op_names[p].op, target_type, a, arg, err)) {
+      goto error;
+    }
+  }
+  g_strfreev(parts);
+  return TRUE;
+ error:
+  g_strfreev(parts);
+  return FALSE;
+}
+
+/* Fill in the results from the reply queue contents */
+void
+dali_batch_decode(DaliBatch *batch)
+{
+  guint i;
+  for (i = 0; i < batch->results->len; i++) {
+    DaliResult *res = &g_array_index(batch->results, DaliResult, i);
+    res->reply = g_array_index(batch->replies, uint16_t, i);
+    res->answered = !(res->reply & DALI_REPLY_NO_ANSWER_MASK);
+    res->value = res->reply & 0xff;
+  }
+}
+
+static void
+format_target(const DaliResult *res, GString *str)
+{
+  switch(res->target_type) {
+  case DALI_TARGET_SHORT:
+    g_string_append_printf(str, "%d", res->addr);
+    break;
+  case DALI_TARGET_GROUP:
+    g_string_append_printf(str, "g%d", res->addr);
+    break;
+  case DALI_TARGET_BROADCAST:
+    g_string_append(str, "bc");
+    break;
+  }
+}
+
+void
+dali_result_format(const DaliResult *res, GString *str)
+{
+  if (res->op == DALI_OP_RAW) {
+    g_string_append_printf(str, "%04x => %04x", res->frame, res->reply);
+    return;
+  }
+  g_string_append_printf(str, "%s ", dali_op_name(res->op));
+  format_target(res, str);
+  if (res->op == DALI_OP_ARC || res->op == DALI_OP_SCENE) {
+    g_string_append_printf(str, " %d", res->arg);
+  }
+  switch(res->op) {
+  case DALI_OP_QUERY_PRESENT:
+    g_string_append(str, res->answered ? ": yes" : ": no");
+    if (res->cached) g_string_append(str, " (cached)");
+    return;
+  case DALI_OP_QUERY_STATUS:
+  case DALI_OP_QUERY_TYPE:
+  case DALI_OP_QUERY_LEVEL:
+    if (!res->answered) {
+      g_string_append(str, ": no answer");
+      return;
+    }
+    break;
+  default:
+    return;
+  }
+  g_string_append_printf(str, ": %d", res->value);
+  if (res->cached) g_string_append(str, " (cached)");
+  if (res->op == DALI_OP_QUERY_STATUS) {
+    if (res->value & DALI_STATUS_GEAR_FAILURE)
+      g_string_append(str, " gear-failure");
+    if (res->value & DALI_STATUS_LAMP_FAILURE)
+      g_string_append(str, " lamp-failure");
+    if (res->value & DALI_STATUS_LAMP_ON) g_string_append(str, " on");
+    if (res->value & DALI_STATUS_LIMIT_ERROR)
+      g_string_append(str, " limit-error");
+    if (res->value & DALI_STATUS_FADING) g_string_append(str, " fading");
+    if (res->value & DALI_STATUS_RESET_STATE) g_string_append(str, " reset");
+    if (res->value & DALI_STATUS_MISSING_ADDR)
+      g_string_append(str, " no-address");
+    if (res->value & DALI_STATUS_POWER_FAILURE)
+      g_string_append(str, " power-failure");
+  }
+}
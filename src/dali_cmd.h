@@ -0,0 +1,120 @@
+#ifndef __DALI_CMD_H__
+#define __DALI_CMD_H__
+
+#include <stdint.h>
+#include <glib.h>
+
+/* Number of frames the gateway accepts in one command queue write */
+#define DALI_BLOCK_MAX 8
+
+#define DALI_SHORT_ADDR_COUNT 64
+#define DALI_GROUP_COUNT 16
+
+/* Reply queue entries hold the backward frame in the low byte. The high
+   byte is non-zero when no backward frame was received. */
+#define DALI_REPLY_NO_ANSWER_MASK 0xff00
+
+/* Bits of the QUERY STATUS answer */
+#define DALI_STATUS_GEAR_FAILURE 0x01
+#define DALI_STATUS_LAMP_FAILURE 0x02
+#define DALI_STATUS_LAMP_ON 0x04
+#define DALI_STATUS_LIMIT_ERROR 0x08
+#define DALI_STATUS_FADING 0x10
+#define DALI_STATUS_RESET_STATE 0x20
+#define DALI_STATUS_MISSING_ADDR 0x40
+#define DALI_STATUS_POWER_FAILURE 0x80
+
+/* Command bytes (sent with the selector bit set) */
+#define DALI_CMD_OFF 0x00
+#define DALI_CMD_RECALL_MAX 0x05
+#define DALI_CMD_RECALL_MIN 0x06
+#define DALI_CMD_GO_TO_SCENE 0x10
+#define DALI_CMD_RESET 0x20
+#define DALI_CMD_QUERY_STATUS 0x90
+#define DALI_CMD_QUERY_GEAR 0x91
+#define DALI_CMD_QUERY_DEVICE_TYPE 0x99
+#define DALI_CMD_QUERY_ACTUAL_LEVEL 0xa0
+
+typedef enum {
+  DALI_TARGET_SHORT,
+  DALI_TARGET_GROUP,
+  DALI_TARGET_BROADCAST
+} DaliTargetType;
+
+typedef enum {
+  DALI_OP_RAW = 0,
+  DALI_OP_ARC,
+  DALI_OP_OFF,
+  DALI_OP_MAX,
+  DALI_OP_MIN,
+  DALI_OP_SCENE,
+  DALI_OP_RESET,
+  DALI_OP_QUERY_STATUS,
+  DALI_OP_QUERY_PRESENT,
+  DALI_OP_QUERY_TYPE,
+  DALI_OP_QUERY_LEVEL
+} DaliOp;
+
+typedef struct DaliResult DaliResult;
+struct DaliResult
+{
+  DaliOp op;
+  DaliTargetType target_type;
+  guint8 addr;
+  guint8 arg;
+  uint16_t frame;
+  /* Second frame of a send-twice command, no result of its own */
+  gboolean repeat;
+  uint16_t reply;
+  gboolean answered;
+  guint8 value;
+  /* Answered from the state cache instead of the bus */
+  gboolean cached;
+};
+
+/* A list of frames together with the block boundaries used when writing
+   them to the command queue. */
+typedef struct DaliBatch DaliBatch;
+struct DaliBatch
+{
+  GArray *frames;  /* uint16_t */
+  GArray *replies; /* uint16_t, same length as frames */
+  GArray *results; /* DaliResult, same length as frames */
+  GArray *blocks;  /* guint, number of frames in each block */
+};
+
+DaliBatch *
+dali_batch_new(void);
+
+void
+dali_batch_free(DaliBatch *batch);
+
+void
+dali_batch_clear(DaliBatch *batch);
+
+gboolean
+dali_batch_add(DaliBatch *batch, DaliOp op, DaliTargetType target_type,
+	       guint addr, guint arg, GError **err);
+
+gboolean
+dali_batch_add_raw(DaliBatch *batch, uint16_t frame);
+
+gboolean
+dali_batch_parse(DaliBatch *batch, const gchar *spec, GError **err);
+
+void
+dali_batch_decode(DaliBatch *batch);
+
+gboolean
+dali_frame_is_query(uint16_t frame);
+
+gboolean
+dali_frame_is_send_twice(uint16_t frame);
+
+const gchar *
+dali_op_name(DaliOp op);
+
+void
+dali_result_format(const DaliResult *res, GString *str);
+
+#endif /* __DALI_CMD_H__ */
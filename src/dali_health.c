@@ -0,0 +1,240 @@
+#include "dali_health.h"
+#include "dali_record.h"
+#include <string.h>
+
+/* Raise an alert when the window has at least ALERT_MIN_EVENTS events
+   and the rate is above ALERT_FACTOR times the baseline plus
+   ALERT_FLOOR. Clear it when the rate falls below half of that. */
+#define ALERT_MIN_EVENTS 5
+#define ALERT_FACTOR 4.0
+#define ALERT_FLOOR 0.02
+
+void
+dali_health_init(DaliHealth *health, DaliHealthAlertFunc func,
+		 gpointer user_data)
+{
+  memset(health, 0, sizeof(*health));
+  health->alert_func = func;
+  health->user_data = user_data;
+}
+
+const gchar *
+dali_health_kind_name(DaliHealthKind kind)
+{
+  return kind == DALI_HEALTH_ERRORS ? "error" : "unanswered";
+}
+
+void
+dali_health_target_name(guint target, GString *str)
+{
+  if (target < DALI_HEALTH_GROUP) {
+    g_string_append_printf(str, "%d", target);
+  } else if (target < DALI_HEALTH_BROADCAST) {
+    g_string_append_printf(str, "g%d", target - DALI_HEALTH_GROUP);
+  } else if (target == DALI_HEALTH_BROADCAST) {
+    g_string_append(str, "bc");
+  } else {
+    g_string_append(str, "bus");
+  }
+}
+
+/* Queries to a single device that are always answered, unlike yes/no
+   queries where no answer means no */
+static gboolean
+expects_answer(uint16_t frame)
+{
+  guint8 a = frame >> 8;
+  guint8 cmd = frame & 0xff;
+  if (a >= 0x80 || !(a & 0x01)) return FALSE;
+  return (cmd == DALI_CMD_QUERY_STATUS
+	  || (cmd >= 0x97 && cmd <= 0x9a)
+	  || (cmd >= DALI_CMD_QUERY_ACTUAL_LEVEL && cmd <= 0xa5)
+	  || (cmd >= 0xb0 && cmd <= 0xc5));
+}
+
+static guint
+frame_target(uint16_t frame)
+{
+  guint8 a = frame >> 8;
+  if (a < 0x80) return a >> 1;
+  if (a < 0xa0) return DALI_HEALTH_GROUP + ((a >> 1) & 0x0f);
+  if (a >= 0xfe) return DALI_HEALTH_BROADCAST;
+  return DALI_HEALTH_BUS;
+}
+
+static void
+rate_counts(const DaliHealthCount *c, DaliHealthKind kind,
+	    guint32 *events, guint32 *total)
+{
+  if (kind == DALI_HEALTH_ERRORS) {
+    *events = c->errors;
+    *total = c->frames;
+  } else {
+    *events = c->unanswered;
+    *total = c->queries;
+  }
+}
+
+static double
+baseline(const DaliHealthTarget *t, DaliHealthKind kind)
+{
+  if (t->base_total[kind] <= 0) return 0;
+  return t->base_events[kind] / t->base_total[kind];
+}
+
+/* Compare the window to the baseline, then add the finished bucket to
+   the baseline unless it's part of an anomaly */
+static void
+check_target(DaliHealth *health, guint target)
+{
+  DaliHealthTarget *t = &health->targets[target];
+  const DaliHealthCount *b = &t->buckets[health->bucket];
+  DaliHealthKind kind;
+  for (kind = DALI_HEALTH_ERRORS; kind <= DALI_HEALTH_UNANSWERED; kind++) {
+    guint32 events;
+    guint32 total;
+    double base = baseline(t, kind);
+    double limit = ALERT_FACTOR * base + ALERT_FLOOR;
+    double rate;
+    rate_counts(&t->window, kind, &events, &total);
+    rate = total > 0 ? (double)events / total : 0;
+    if (!t->alert[kind] && events >= ALERT_MIN_EVENTS && rate > limit) {
+      t->alert[kind] = TRUE;
+      if (health->alert_func) {
+	health->alert_func(health, target, kind, TRUE, rate, base,
+			   health->user_data);
+      }
+    } else if (t->alert[kind] && rate < limit / 2) {
+      t->alert[kind] = FALSE;
+      if (health->alert_func) {
+	health->alert_func(health, target, kind, FALSE, rate, base,
+			   health->user_data);
+      }
+    }
+    if (!t->alert[kind]) {
+      double keep = 1.0 - 1.0 / DALI_HEALTH_BASELINE_BUCKETS;
+      rate_counts(b, kind, &events, &total);
+      t->base_events[kind] = t->base_events[kind] * keep + events;
+      t->base_total[kind] = t->base_total[kind] * keep + total;
+    }
+  }
+}
+
+static void
+next_bucket(DaliHealth *health)
+{
+  guint i;
+  for (i = 0; i < DALI_HEALTH_TARGETS; i++) {
+    check_target(health, i);
+  }
+  health->bucket = (health->bucket + 1) % DALI_HEALTH_BUCKETS;
+  for (i = 0; i < DALI_HEALTH_TARGETS; i++) {
+    DaliHealthTarget *t = &health->targets[i];
+    DaliHealthCount *old = &t->buckets[health->bucket];
+    t->window.frames -= old->frames;
+    t->window.errors -= old->errors;
+    t->window.queries -= old->queries;
+    t->window.unanswered -= old->unanswered;
+    memset(old, 0, sizeof(*old));
+  }
+  health->bucket_end += DALI_HEALTH_BUCKET_TIME;
+}
+
+static void
+count(DaliHealth *health, guint target, guint32 frames, guint32 errors,
+      guint32 queries, guint32 unanswered)
+{
+  DaliHealthTarget *t = &health->targets[target];
+  DaliHealthCount *b = &t->buckets[health->bucket];
+  b->frames += frames;
+  b->errors += errors;
+  b->queries += queries;
+  b->unanswered += unanswered;
+  t->window.frames += frames;
+  t->window.errors += errors;
+  t->window.queries += queries;
+  t->window.unanswered += unanswered;
+}
+
+/* Add one record. Times must not go backwards. */
+void
+dali_health_observe(DaliHealth *health, const uint16_t *rec, gint64 time)
+{
+  gboolean error = DALI_RECORD_IS_ERROR(rec);
+  guint rounds = 0;
+  if (health->bucket_end == 0) {
+    health->bucket_end = time + DALI_HEALTH_BUCKET_TIME;
+  }
+  while (time >= health->bucket_end) {
+    if (++rounds > DALI_HEALTH_BUCKETS) {
+      /* Every bucket is empty by now, skip the rest of the silence */
+      health->bucket_end +=
+	(time - health->bucket_end) / DALI_HEALTH_BUCKET_TIME
+	* DALI_HEALTH_BUCKET_TIME;
+    }
+    next_bucket(health);
+  }
+
+  if (health->pending_valid) {
+    uint16_t query = health->pending;
+    guint target = frame_target(query);
+    health->pending_valid = FALSE;
+    if (DALI_RECORD_IS_ANSWER(rec)) {
+      if (target < DALI_HEALTH_GROUP) {
+	health->targets[target].present = TRUE;
+	count(health, target, 1, error, expects_answer(query), 0);
+      } else {
+	/* Several devices may answer at once, so errors are expected */
+	count(health, target, 1, 0, 0, 0);
+      }
+      return;
+    }
+    if (expects_answer(query) && health->targets[target].present) {
+      count(health, target, 0, 0, 1, 1);
+    }
+  }
+  if (!DALI_RECORD_IS_FORWARD(rec) || error) {
+    /* A backward frame without a query or a forward frame that can't be
+       trusted */
+    count(health, DALI_HEALTH_BUS, 1, error, 0, 0);
+    return;
+  }
+  count(health, frame_target(rec[0]), 1, 0, 0, 0);
+  if (dali_frame_is_query(rec[0])) {
+    health->pending = rec[0];
+    health->pending_valid = TRUE;
+  }
+}
+
+static void
+format_rate(const DaliHealthTarget *t, DaliHealthKind kind, GString *str)
+{
+  guint32 events;
+  guint32 total;
+  rate_counts(&t->window, kind, &events, &total);
+  g_string_append_printf(str, " %s=%u/%u", dali_health_kind_name(kind),
+			 events, total);
+  if (total > 0) {
+    g_string_append_printf(str, " (%.1f%%, base %.1f%%)",
+			   100.0 * events / total, 100.0 * baseline(t, kind));
+  }
+  if (t->alert[kind]) g_string_append(str, " ALERT");
+}
+
+/* One line for every target with traffic in the window */
+void
+dali_health_format(const DaliHealth *health, GString *str)
+{
+  guint i;
+  for (i = 0; i < DALI_HEALTH_TARGETS; i++) {
+    const DaliHealthTarget *t = &health->targets[i];
+    if (t->window.frames == 0 && t->window.queries == 0
+	&& !t->alert[DALI_HEALTH_ERRORS] && !t->alert[DALI_HEALTH_UNANSWERED]) {
+      continue;
+    }
+    dali_health_target_name(i, str);
+    format_rate(t, DALI_HEALTH_ERRORS, str);
+    format_rate(t, DALI_HEALTH_UNANSWERED, str);
+    g_string_append_c(str, '\n');
+  }
+}
@@ -0,0 +1,87 @@
+#ifndef __DALI_HEALTH_H__
+#define __DALI_HEALTH_H__
+
+#include <stdint.h>
+#include <glib.h>
+#include "dali_cmd.h"
+
+/* Rates are counted in buckets of this length (us) */
+#define DALI_HEALTH_BUCKET_TIME (10 * G_USEC_PER_SEC)
+/* and compared over a window of this many buckets (5 min) */
+#define DALI_HEALTH_BUCKETS 30
+/* to a baseline averaged over about this many buckets (1 h) */
+#define DALI_HEALTH_BASELINE_BUCKETS 360
+
+/* Targets are short addresses, then groups, broadcast and finally
+   frames that can't be attributed to any address */
+#define DALI_HEALTH_GROUP DALI_SHORT_ADDR_COUNT
+#define DALI_HEALTH_BROADCAST (DALI_HEALTH_GROUP + DALI_GROUP_COUNT)
+#define DALI_HEALTH_BUS (DALI_HEALTH_BROADCAST + 1)
+#define DALI_HEALTH_TARGETS (DALI_HEALTH_BUS + 1)
+
+typedef enum {
+  DALI_HEALTH_ERRORS,    /* Corrupted frames per frame */
+  DALI_HEALTH_UNANSWERED /* Unanswered queries per query */
+} DaliHealthKind;
+
+typedef struct DaliHealthCount DaliHealthCount;
+struct DaliHealthCount
+{
+  guint32 frames;
+  guint32 errors;
+  guint32 queries;
+  guint32 unanswered;
+};
+
+typedef struct DaliHealthTarget DaliHealthTarget;
+struct DaliHealthTarget
+{
+  DaliHealthCount buckets[DALI_HEALTH_BUCKETS];
+  DaliHealthCount window; /* Sum of buckets */
+  /* Exponentially decaying event and opportunity counts, indexed by
+     DaliHealthKind */
+  double base_events[2];
+  double base_total[2];
+  gboolean alert[2];
+  /* Has answered a query, so an unanswered query is unexpected */
+  gboolean present;
+};
+
+typedef struct DaliHealth DaliHealth;
+
+typedef void (*DaliHealthAlertFunc)(DaliHealth *health, guint target,
+				    DaliHealthKind kind, gboolean raised,
+				    double rate, double baseline,
+				    gpointer user_data);
+
+/* State for one bus. Fixed size, so any number of gateways can be
+   followed with bounded memory. */
+struct DaliHealth
+{
+  DaliHealthTarget targets[DALI_HEALTH_TARGETS];
+  gint64 bucket_end; /* 0 before the first record */
+  guint bucket;
+  /* Last forward query, waiting for a backward frame */
+  uint16_t pending;
+  gboolean pending_valid;
+  DaliHealthAlertFunc alert_func;
+  gpointer user_data;
+};
+
+void
+dali_health_init(DaliHealth *health, DaliHealthAlertFunc func,
+		 gpointer user_data);
+
+void
+dali_health_observe(DaliHealth *health, const uint16_t *rec, gint64 time);
+
+void
+dali_health_format(const DaliHealth *health, GString *str);
+
+void
+dali_health_target_name(guint target, GString *str);
+
+const gchar *
+dali_health_kind_name(DaliHealthKind kind);
+
+#endif /* __DALI_HEALTH_H__ */
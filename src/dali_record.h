@@ -0,0 +1,25 @@
+#ifndef __DALI_RECORD_H__
+#define __DALI_RECORD_H__
+
+#include <stdint.h>
+
+/* A sniffed record is two registers, the frame and a flag word. The
+   flag word holds the time since the previous record in ms in bits
+   6-15, bit 3 is set for forward frames and bits 1-2 for corrupted
+   frames. */
+#define DALI_RECORD_FORWARD 0x08
+#define DALI_RECORD_ERROR 0x06
+
+#define DALI_RECORD_IS_FORWARD(rec) (((rec)[1] & DALI_RECORD_FORWARD) != 0)
+#define DALI_RECORD_IS_ERROR(rec) (((rec)[1] & DALI_RECORD_ERROR) != 0)
+#define DALI_RECORD_DELAY(rec) ((rec)[1] >> 6)
+
+/* A backward frame later than this after a query is not an answer */
+#define DALI_ANSWER_MAX_DELAY_MS 100
+
+/* Whether rec answers the query in the record before it */
+#define DALI_RECORD_IS_ANSWER(rec)					\
+  (!DALI_RECORD_IS_FORWARD(rec)						\
+   && DALI_RECORD_DELAY(rec) <= DALI_ANSWER_MAX_DELAY_MS)
+
+#endif /* __DALI_RECORD_H__ */
@@ -0,0 +1,282 @@
+#include "dali_state.h"
+#include "dali_record.h"
+#include <string.h>
+
+static void
+device_init(DaliDeviceState *dev)
+{
+  memset(dev, 0, sizeof(*dev));
+  dev->level = DALI_LEVEL_UNKNOWN;
+  dev->target = DALI_LEVEL_UNKNOWN;
+  dev->scene = DALI_SCENE_NONE;
+}
+
+void
+dali_state_init(DaliState *state)
+{
+  unsigned int i;
+  for (i = 0; i < DALI_SHORT_ADDR_COUNT; i++) {
+    device_init(&state->devices[i]);
+  }
+  for (i = 0; i < DALI_GROUP_COUNT; i++) {
+    device_init(&state->groups[i]);
+  }
+  state->pending = 0;
+  state->pending_valid = FALSE;
+  state->changed = 0;
+}
+
+/* Any command that changes the arc level also changes the lamp and
+   power bits of the status, so a cached status is dropped with it. Only
+   OFF is immediate, after the others the actual level has to be
+   queried. */
+static void
+apply_command(DaliDeviceState *dev, guint8 addr_byte, guint8 data, gint64 now)
+{
+  if (!(addr_byte & 0x01)) {
+    /* 0xff is MASK, it stops a fade at an unknown level */
+    dev->target = data;
+    dev->level_time = 0;
+    dev->status_time = 0;
+    if (data != 0xff) dev->scene = DALI_SCENE_NONE;
+    return;
+  }
+  if (data == DALI_CMD_OFF) {
+    dev->level = 0;
+    dev->target = 0;
+    dev->level_time = now;
+    dev->status_time = 0;
+    dev->scene = DALI_SCENE_NONE;
+  } else if (data == DALI_CMD_RECALL_MAX || data == DALI_CMD_RECALL_MIN) {
+    dev->target = DALI_LEVEL_UNKNOWN;
+    dev->level_time = 0;
+    dev->status_time = 0;
+    dev->scene = DALI_SCENE_NONE;
+  } else if ((data & 0xf0) == DALI_CMD_GO_TO_SCENE) {
+    dev->target = DALI_LEVEL_UNKNOWN;
+    dev->level_time = 0;
+    dev->status_time = 0;
+    dev->scene = data & 0x0f;
+  } else if (data <= 0x1f) {
+    /* Other arc power commands, the resulting level is unknown */
+    dev->target = DALI_LEVEL_UNKNOWN;
+    dev->level_time = 0;
+    dev->status_time = 0;
+  }
+}
+
+static void
+observe_forward(DaliState *state, uint16_t frame, gint64 now)
+{
+  guint8 a = frame >> 8;
+  guint8 data = frame & 0xff;
+  unsigned int i;
+  if (dali_frame_is_query(frame)) {
+    state->pending = frame;
+    state->pending_valid = TRUE;
+    return;
+  }
+  if (a < 0x80) {
+    state->devices[a >> 1].last_seen = now;
+    apply_command(&state->devices[a >> 1], a, data, now);
+  } else if (a < 0xa0) {
+    state->groups[(a >> 1) & 0x0f].last_seen = now;
+    apply_command(&state->groups[(a >> 1) & 0x0f], a, data, now);
+    if (!(a & 0x01) || data <= 0x1f) {
+      /* Group membership is not known, so the level of any device may
+	 have changed */
+      for (i = 0; i < DALI_SHORT_ADDR_COUNT; i++) {
+	state->devices[i].level_time = 0;
+	state->devices[i].status_time = 0;
+      }
+    }
+  } else if (a >= 0xfe) {
+    /* Addresses that haven't been seen may not exist, leave them out of
+       the table */
+    for (i = 0; i < DALI_SHORT_ADDR_COUNT; i++) {
+      if (state->devices[i].last_seen != 0) {
+	apply_command(&state->devices[i], a, data, now);
+      }
+    }
+    for (i = 0; i < DALI_GROUP_COUNT; i++) {
+      if (state->groups[i].last_seen != 0) {
+	apply_command(&state->groups[i], a, data, now);
+      }
+    }
+  } else {
+    /* Special commands don't change the state of any device */
+    return;
+  }
+  state->changed = now;
+}
+
+static void
+observe_answer(DaliState *state, guint8 answer, gint64 now)
+{
+  guint8 a = state->pending >> 8;
+  DaliDeviceState *dev;
+  if (a >= 0x80) return;
+  dev = &state->devices[a >> 1];
+  dev->last_seen = now;
+  dev->answer_time = now;
+  switch(state->pending & 0xff) {
+  case DALI_CMD_QUERY_STATUS:
+    dev->status = answer;
+    dev->status_time = now;
+    break;
+  case DALI_CMD_QUERY_ACTUAL_LEVEL:
+    dev->level = answer;
+    dev->level_time = now;
+    break;
+  }
+  state->changed = now;
+}
+
+/* Update the table from one sniffed record */
+void
+dali_state_observe(DaliState *state, const uint16_t *rec, gint64 now)
+{
+  gboolean pending = state->pending_valid;
+  state->pending_valid = FALSE;
+  if (DALI_RECORD_IS_ERROR(rec)) {
+    /* Corrupted frame */
+    return;
+  }
+  if (DALI_RECORD_IS_FORWARD(rec)) {
+    observe_forward(state, rec[0], now);
+  } else if (pending && DALI_RECORD_IS_ANSWER(rec)) {
+    observe_answer(state, rec[0] & 0xff, now);
+  }
+}
+
+/* Answer a query from the table if the cached value is at most max_age
+   old. Returns FALSE if the query has to go to the bus. */
+gboolean
+dali_state_lookup(const DaliState *state, DaliResult *res,
+		  gint64 now, gint64 max_age)
+{
+  const DaliDeviceState *dev;
+  if (res->target_type != DALI_TARGET_SHORT
+      || res->addr >= DALI_SHORT_ADDR_COUNT) {
+    return FALSE;
+  }
+  dev = &state->devices[res->addr];
+  switch(res->op) {
+  case DALI_OP_QUERY_LEVEL:
+    if (dev->level_time == 0 || now - dev->level_time > max_age
+	|| dev->level == DALI_LEVEL_UNKNOWN) {
+      return FALSE;
+    }
+    res->value = dev->level;
+    break;
+  case DALI_OP_QUERY_STATUS:
+    if (dev->status_time == 0 || now - dev->status_time > max_age) {
+      return FALSE;
+    }
+    res->value = dev->status;
+    break;
+  case DALI_OP_QUERY_PRESENT:
+    /* Only a recent answer proves presence */
+    if (dev->answer_time == 0 || now - dev->answer_time > max_age) {
+      return FALSE;
+    }
+    res->value = 0xff;
+    break;
+  default:
+    return FALSE;
+  }
+  res->answered = TRUE;
+  res->cached = TRUE;
+  res->reply = res->value;
+  return TRUE;
+}
+
+/* Answer what can be answered from the table and add everything else to
+   stale, in order. The replies for stale are copied back into batch by
+   calling dali_state_merge() after it has been sent. */
+void
+dali_state_resolve(const DaliState *state, DaliBatch *batch,
+		   gint64 now, gint64 max_age, DaliBatch *stale)
+{
+  guint i;
+  for (i = 0; i < batch->results->len; i++) {
+    DaliResult *res = &g_array_index(batch->results, DaliResult, i);
+    if (res->repeat) {
+      /* Raw pairs are formed again by dali_batch_add_raw() */
+      if (res->op == DALI_OP_RAW) dali_batch_add_raw(stale, res->frame);
+      continue;
+    }
+    if (dali_state_lookup(state, res, now, max_age)) continue;
+    if (res->op == DALI_OP_RAW) {
+      dali_batch_add_raw(stale, res->frame);
+    } else {
+      dali_batch_add(stale, res->op, res->target_type, res->addr, res->arg,
+		     NULL);
+    }
+  }
+}
+
+void
+dali_state_merge(DaliBatch *batch, const DaliBatch *stale)
+{
+  guint i;
+  guint s = 0;
+  for (i = 0; i < batch->results->len; i++) {
+    DaliResult *res = &g_array_index(batch->results, DaliResult, i);
+    const DaliResult *sres;
+    if (res->repeat || res->cached) continue;
+    while (s < stale->results->len
+	   && g_array_index(stale->results, DaliResult, s).repeat) {
+      s++;
+    }
+    if (s == stale->results->len) break;
+    sres = &g_array_index(stale->results, DaliResult, s++);
+    res->reply = sres->reply;
+    res->answered = sres->answered;
+    res->value = sres->value;
+  }
+}
+
+static void
+format_entry(const DaliDeviceState *dev, gint64 now, GString *str)
+{
+  if (dev->level_time != 0 && dev->level != DALI_LEVEL_UNKNOWN) {
+    g_string_append_printf(str, " level=%d", dev->level);
+  } else {
+    g_string_append(str, " level=-");
+  }
+  if (dev->target != DALI_LEVEL_UNKNOWN) {
+    g_string_append_printf(str, " target=%d", dev->target);
+  } else {
+    g_string_append(str, " target=-");
+  }
+  if (dev->scene != DALI_SCENE_NONE) {
+    g_string_append_printf(str, " scene=%d", dev->scene);
+  } else {
+    g_string_append(str, " scene=-");
+  }
+  if (dev->status_time != 0) {
+    g_string_append_printf(str, " status=0x%02x", dev->status);
+  } else {
+    g_string_append(str, " status=-");
+  }
+  g_string_append_printf(str, " age=%" G_GINT64_FORMAT "ms\n",
+			 (now - dev->last_seen) / 1000);
+}
+
+/* One line for every address or group that has been seen */
+void
+dali_state_format(const DaliState *state, gint64 now, GString *str)
+{
+  unsigned int i;
+  for (i = 0; i < DALI_SHORT_ADDR_COUNT; i++) {
+    if (state->devices[i].last_seen == 0) continue;
+    g_string_append_printf(str, "%d", i);
+    format_entry(&state->devices[i], now, str);
+  }
+  for (i = 0; i < DALI_GROUP_COUNT; i++) {
+    if (state->groups[i].last_seen == 0) continue;
+    g_string_append_printf(str, "g%d", i);
+    format_entry(&state->groups[i], now, str);
+  }
+}
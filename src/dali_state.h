@@ -0,0 +1,60 @@
+#ifndef __DALI_STATE_H__
+#define __DALI_STATE_H__
+
+#include <stdint.h>
+#include <glib.h>
+#include "dali_cmd.h"
+
+#define DALI_LEVEL_UNKNOWN 0xff
+#define DALI_SCENE_NONE 0xff
+
+/* What is known about one short address or group. Times are from
+   g_get_monotonic_time(), zero means never. */
+typedef struct DaliDeviceState DaliDeviceState;
+struct DaliDeviceState
+{
+  gint64 last_seen;
+  gint64 answer_time;
+  gint64 level_time;
+  gint64 status_time;
+  guint8 level;
+  /* Level last requested with direct arc power. The device fades to it
+     and clamps it to its limits, so it is never used as an answer. */
+  guint8 target;
+  guint8 scene;
+  guint8 status;
+};
+
+typedef struct DaliState DaliState;
+struct DaliState
+{
+  DaliDeviceState devices[DALI_SHORT_ADDR_COUNT];
+  DaliDeviceState groups[DALI_GROUP_COUNT];
+  /* Last forward query, waiting for a backward frame */
+  uint16_t pending;
+  gboolean pending_valid;
+  /* Time of the last change to the table */
+  gint64 changed;
+};
+
+void
+dali_state_init(DaliState *state);
+
+void
+dali_state_observe(DaliState *state, const uint16_t *rec, gint64 now);
+
+gboolean
+dali_state_lookup(const DaliState *state, DaliResult *res,
+		  gint64 now, gint64 max_age);
+
+void
+dali_state_resolve(const DaliState *state, DaliBatch *batch,
+		   gint64 now, gint64 max_age, DaliBatch *stale);
+
+void
+dali_state_merge(DaliBatch *batch, const DaliBatch *stale);
+
+void
+dali_state_format(const DaliState *state, gint64 now, GString *str);
+
+#endif /* __DALI_STATE_H__ */
@@ -0,0 +1,97 @@
+#include "dali_timing.h"
+#include "dali_cmd.h"
+
+/* DALI runs at 1200 bit/s, Te is half a bit */
+#define TE 417
+#define FORWARD_FRAME (38 * TE)
+#define BACKWARD_FRAME (22 * TE)
+/* Longest wait for a backward frame */
+#define BACKWARD_WAIT (22 * TE)
+/* Settling time before the next forward frame */
+#define SETTLING (22 * TE)
+
+/* Interval between checks after the first one */
+#define MIN_CHECK_INTERVAL 2000
+#define MAX_CHECK_INTERVAL 50000
+/* Give up after this many times the prediction, but never sooner than
+   DEADLINE_MIN after writing the block */
+#define DEADLINE_FACTOR 4
+#define DEADLINE_MIN 500000
+
+/* Weight of a new sample, 1/SCALE_WEIGHT */
+#define SCALE_WEIGHT 8
+/* Shrink the scale by this factor when the block was already done at the
+   first check, since then the actual time is unknown */
+#define SCALE_PROBE 0.97
+#define SCALE_MIN 0.5
+#define SCALE_MAX 4.0
+
+void
+dali_timing_init(DaliTiming *timing)
+{
+  timing->scale = 1.0;
+  timing->blocks = 0;
+  timing->timeouts = 0;
+  timing->predicted_total = 0;
+  timing->actual_total = 0;
+}
+
+/* Nominal bus time for the frames, scaled by what has been learned */
+gint64
+dali_timing_predict(const DaliTiming *timing, const uint16_t *frames,
+		    guint n)
+{
+  gint64 t = 0;
+  guint i;
+  for (i = 0; i < n; i++) {
+    t += FORWARD_FRAME + SETTLING;
+    if (dali_frame_is_query(frames[i])) {
+      t += BACKWARD_WAIT + BACKWARD_FRAME;
+    }
+  }
+  return t * timing->scale;
+}
+
+gint64
+dali_timing_deadline(gint64 predicted)
+{
+  return MAX(predicted * DEADLINE_FACTOR, DEADLINE_MIN);
+}
+
+/* Time to wait before the next check, given the previous interval or
+   zero after the first check */
+gint64
+dali_timing_backoff(gint64 predicted, gint64 interval)
+{
+  if (interval == 0) {
+    return CLAMP(predicted / 8, MIN_CHECK_INTERVAL, MAX_CHECK_INTERVAL);
+  }
+  return MIN(interval * 2, MAX_CHECK_INTERVAL);
+}
+
+void
+dali_timing_update(DaliTiming *timing, gint64 predicted, gint64 actual,
+		   gboolean first_check)
+{
+  timing->blocks++;
+  timing->predicted_total += predicted;
+  timing->actual_total += actual;
+  if (predicted <= 0) return;
+  if (first_check) {
+    timing->scale *= SCALE_PROBE;
+  } else {
+    gdouble ratio = timing->scale * actual / predicted;
+    timing->scale += (ratio - timing->scale) / SCALE_WEIGHT;
+  }
+  timing->scale = CLAMP(timing->scale, SCALE_MIN, SCALE_MAX);
+  g_debug("Block predicted %" G_GINT64_FORMAT "us, took %" G_GINT64_FORMAT
+	  "us, scale %.3f", predicted, actual, timing->scale);
+}
+
+void
+dali_timing_timeout(DaliTiming *timing, gint64 predicted)
+{
+  timing->timeouts++;
+  timing->blocks++;
+  timing->predicted_total += predicted;
+}
@@ -0,0 +1,40 @@
+#ifndef __DALI_TIMING_H__
+#define __DALI_TIMING_H__
+
+#include <stdint.h>
+#include <glib.h>
+
+/* Predicts how long the gateway needs to execute a command queue block
+   and learns from the actual completion times. Times are in us. */
+typedef struct DaliTiming DaliTiming;
+struct DaliTiming
+{
+  /* Correction applied to the nominal bus time */
+  gdouble scale;
+  guint64 blocks;
+  guint64 timeouts;
+  gint64 predicted_total;
+  gint64 actual_total;
+};
+
+void
+dali_timing_init(DaliTiming *timing);
+
+gint64
+dali_timing_predict(const DaliTiming *timing, const uint16_t *frames,
+		    guint n);
+
+gint64
+dali_timing_deadline(gint64 predicted);
+
+gint64
+dali_timing_backoff(gint64 predicted, gint64 interval);
+
+void
+dali_timing_update(DaliTiming *timing, gint64 predicted, gint64 actual,
+		   gboolean first_check);
+
+void
+dali_timing_timeout(DaliTiming *timing, gint64 predicted);
+
+#endif /* __DALI_TIMING_H__ */
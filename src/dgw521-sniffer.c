@@ -2,9 +2,20 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <glib.h>
 #include <glib-unix.h>
-#include <modbus-rtu.h>
+#include "dali_state.h"
+#include "dali_health.h"
+#include "dgw_error.h"
+#include "dgw_trace.h"
+#include "dgw_keepalive.h"
+#include "capture.h"
+#include "dgw_device.h"
+#include "dgw_ring.h"
+#include "control.h"
+#include "timeline.h"
 
 typedef struct ModbusSource ModbusSource;
 struct ModbusSource {
@@ -12,6 +23,37 @@ struct ModbusSource {
   gpointer tag;
 };
 
+typedef enum {
+  POLL_SEQUENCE,
+  POLL_SNAPSHOT
+} PollMode;
+
+/* Counters used to compare the poll modes */
+typedef struct PollStats PollStats;
+struct PollStats
+{
+  guint64 polls;
+  guint64 empty_polls;
+  guint64 ambiguous;
+  guint64 transactions;
+  guint64 records;
+  guint64 overruns;
+};
+
+/* A command received on the control socket */
+typedef struct Command Command;
+struct Command
+{
+  ControlClient *client;
+  DaliBatch *batch;
+  /* What actually goes to the bus, set when the command is started */
+  DaliBatch *send;
+  guint pos;
+  /* Answer queries from the state table if not older than this (us) */
+  gint64 max_age;
+  GError *error;
+};
+
 typedef struct AppContext AppContext;
 struct AppContext
 {
@@ -19,13 +61,53 @@ struct AppContext
   guint speed;
   guint mb_addr;
   gboolean debug;
+  gchar *trace_file;
   gboolean decode;
+  gboolean timestamps;
+  gchar *poll_mode_str;
+  PollMode poll_mode;
+  gchar *state_file;
+  gchar *health_file;
+  gboolean keepalive;
+  gchar *capture_prefix;
+  gint rotate_size;
+  gint rotate_time;
+  gint commit_interval;
+  gint sync_interval;
+  gchar *control_path;
+  gint control_budget;
   
-  modbus_t *mb;
+  DgwDevice *dev;
   GThread *mb_thread;
   GMutex mb_mutex;
   GCond mb_cond;
   gboolean mb_thread_running;
+
+  uint16_t last_seq;
+  /* Records have been lost since the last batch was handled */
+  gboolean records_lost;
+  /* Last ring contents in snapshot mode */
+  uint16_t ring[DGW_RING_REGS];
+  guint unchanged_polls;
+  PollStats stats;
+  Timeline timeline;
+
+  DaliState state;
+  gint64 state_written;
+
+  DaliHealth *health;
+  gint64 health_written;
+
+  DgwKeepalive ka;
+
+  CaptureWriter *capture;
+
+  ControlServer *control;
+  GAsyncQueue *commands;
+  /* Only used by the Modbus thread */
+  Command *command;
+  gint64 command_credit;
+  gint64 credit_time;
 };
 
 
@@ -36,8 +118,39 @@ app_init(AppContext *app)
   app->speed = 38400;
   app->mb_addr = 1;
   app->debug = 0;
+  app->trace_file = NULL;
   app->decode = FALSE;
-  app->mb = NULL;
+  app->timestamps = FALSE;
+  app->poll_mode_str = NULL;
+  app->poll_mode = POLL_SEQUENCE;
+  app->last_seq = 0;
+  app->records_lost = FALSE;
+  memset(app->ring, 0, sizeof(app->ring));
+  app->unchanged_polls = 0;
+  memset(&app->stats, 0, sizeof(app->stats));
+  timeline_init(&app->timeline);
+  app->state_file = NULL;
+  dali_state_init(&app->state);
+  app->state_written = 0;
+  app->health_file = NULL;
+  app->health = NULL;
+  app->health_written = 0;
+  app->keepalive = FALSE;
+  dgw_keepalive_init(&app->ka);
+  app->capture_prefix = NULL;
+  app->rotate_size = 0;
+  app->rotate_time = 0;
+  app->commit_interval = CAPTURE_COMMIT_INTERVAL / 1000;
+  app->sync_interval = CAPTURE_SYNC_INTERVAL / 1000;
+  app->capture = NULL;
+  app->control_path = NULL;
+  app->control_budget = 50;
+  app->control = NULL;
+  app->commands = NULL;
+  app->command = NULL;
+  app->command_credit = 0;
+  app->credit_time = 0;
+  app->dev = NULL;
   app->mb_thread_running = FALSE;
   g_mutex_init(&app->mb_mutex);
   g_cond_init(&app->mb_cond);
@@ -46,21 +159,109 @@ app_init(AppContext *app)
 static void
 stop_mb_thread(AppContext *app);
 
+static void
+command_free(Command *cmd)
+{
+  if (cmd->client) control_client_unref(cmd->client);
+  dali_batch_free(cmd->batch);
+  dali_batch_free(cmd->send);
+  g_clear_error(&cmd->error);
+  g_free(cmd);
+}
+
 static void
 app_cleanup(AppContext* app)
 {
   stop_mb_thread(app); 
-  if (app->mb) {
-    modbus_close(app->mb);
-    modbus_free(app->mb);
-    app->mb = NULL;
+  if (app->command) {
+    command_free(app->command);
+    app->command = NULL;
+  }
+  if (app->commands) {
+    Command *cmd;
+    while((cmd = g_async_queue_try_pop(app->commands))) {
+      command_free(cmd);
+    }
+    g_async_queue_unref(app->commands);
+    app->commands = NULL;
   }
+  control_server_free(app->control);
+  app->control = NULL;
+  if (app->stats.polls > 0) {
+    g_message("%s polling: %" G_GUINT64_FORMAT " polls (%" G_GUINT64_FORMAT
+	      " empty, %" G_GUINT64_FORMAT " ambiguous), %" G_GUINT64_FORMAT
+	      " transactions, %" G_GUINT64_FORMAT " records, %"
+	      G_GUINT64_FORMAT " overruns, %.2f transactions per record",
+	      app->poll_mode == POLL_SNAPSHOT ? "Snapshot" : "Sequence",
+	      app->stats.polls, app->stats.empty_polls, app->stats.ambiguous,
+	      app->stats.transactions, app->stats.records,
+	      app->stats.overruns,
+	      app->stats.records > 0
+	      ? (double)app->stats.transactions / app->stats.records : 0.0);
+  }
+  if (app->dev && dgw_device_timing(app->dev)->blocks > 0) {
+    const DaliTiming *timing = dgw_device_timing(app->dev);
+    g_message("Commands: %" G_GUINT64_FORMAT " blocks, %" G_GUINT64_FORMAT
+	      " timeouts, predicted %" G_GINT64_FORMAT "ms, took %"
+	      G_GINT64_FORMAT "ms", timing->blocks, timing->timeouts,
+	      timing->predicted_total / 1000, timing->actual_total / 1000);
+  }
+  if (app->timeline.rate != 1.0) {
+    g_message("Gateway clock drift: %.1f ppm",
+	      timeline_drift_ppm(&app->timeline));
+  }
+  if (app->ka.trips_valid) {
+    g_message("Watchdog trips: %d", app->ka.trips);
+  }
+  dgw_device_close(app->dev);
+  app->dev = NULL;
+  g_free(app->state_file);
+  g_free(app->health_file);
+  g_free(app->health);
+  capture_writer_free(app->capture);
+  app->capture = NULL;
+  g_free(app->capture_prefix);
+  g_free(app->poll_mode_str);
+  g_free(app->control_path);
+  g_free(app->trace_file);
 }
 
-#define MB_ADDR_SEQUENCE 322
-#define MB_ADDR_RECORDS 1024
-/* Don't read the full buffer since the oldest records risk being overwritten.*/
-#define MAX_RECORDS 24
+/* In snapshot mode, check the sequence number after this many polls
+   without changes */
+#define SNAPSHOT_VERIFY_POLLS 10
+
+#define POLL_INTERVAL (G_USEC_PER_SEC/10)
+
+/* Reading the whole ring is a request and a response of 141 characters
+   together, plus 3.5 characters of silence after each, at 10 bits per
+   character. Snapshot mode is only used if that takes at most half of
+   POLL_INTERVAL so there is time left for commands, i.e. from 38400
+   bps. At 19200 bps it takes 77 ms and at 9600 bps 154 ms, longer than
+   the poll interval. */
+#define RING_READ_CHARS (8 + 5 + DGW_RING_REGS * 2 + 7)
+#define RING_READ_TIME(speed) \
+  ((gint64)RING_READ_CHARS * 10 * G_USEC_PER_SEC / (speed))
+
+/* Consecutive records are at least a backward frame and the shortest
+   settling time apart, so DGW_MAX_RECORDS new records take at least
+   OVERRUN_TIME. The ring is always read between two command blocks and
+   a block is only as long as can be sent well within that time. */
+#define RECORD_MIN_INTERVAL 12000
+#define OVERRUN_TIME (DGW_MAX_RECORDS * RECORD_MIN_INTERVAL)
+#define COMMAND_BLOCK_TIME (OVERRUN_TIME * 3 / 4)
+/* Commands waiting to be sent */
+#define COMMAND_QUEUE_MAX 16
+
+static void
+print_time(gint64 real)
+{
+  time_t secs = real / G_USEC_PER_SEC;
+  struct tm tm;
+  char buffer[32];
+  localtime_r(&secs, &tm);
+  strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm);
+  printf("%s.%03d ", buffer, (int)(real % G_USEC_PER_SEC / 1000));
+}
 
 static void
 print_record(const uint16_t *rec)
@@ -81,77 +282,394 @@ print_record(const uint16_t *rec)
   printf("\n");
 }
 
+/* Minimum time between rewrites of the state file */
+#define STATE_WRITE_INTERVAL G_USEC_PER_SEC
+
+static void
+write_state(AppContext *app, gint64 now)
+{
+  GError *err = NULL;
+  GString *str;
+  if (!app->state_file || app->state.changed <= app->state_written
+      || now - app->state_written < STATE_WRITE_INTERVAL) {
+    return;
+  }
+  str = g_string_new("");
+  dali_state_format(&app->state, now, str);
+  if (!g_file_set_contents(app->state_file, str->str, str->len, &err)) {
+    g_printerr("Failed to write state file: %s\n", err->message);
+    g_clear_error(&err);
+  }
+  g_string_free(str, TRUE);
+  app->state_written = now;
+}
+
+static void
+health_alert(DaliHealth *health, guint target, DaliHealthKind kind,
+	     gboolean raised, double rate, double baseline, gpointer user_data)
+{
+  GString *name = g_string_new("");
+  dali_health_target_name(target, name);
+  if (raised) {
+    g_warning("Address %s: %s rate %.1f%% (baseline %.1f%%)", name->str,
+	      dali_health_kind_name(kind), rate * 100, baseline * 100);
+  } else {
+    g_message("Address %s: %s rate back to %.1f%%", name->str,
+	      dali_health_kind_name(kind), rate * 100);
+  }
+  g_string_free(name, TRUE);
+}
+
+static void
+write_health(AppContext *app, gint64 now)
+{
+  GError *err = NULL;
+  GString *str;
+  if (now - app->health_written < DALI_HEALTH_BUCKET_TIME) return;
+  str = g_string_new("");
+  dali_health_format(app->health, str);
+  if (!g_file_set_contents(app->health_file, str->str, str->len, &err)) {
+    g_printerr("Failed to write health file: %s\n", err->message);
+    g_clear_error(&err);
+  }
+  g_string_free(str, TRUE);
+  app->health_written = now;
+}
+
+static void
+handle_records(AppContext *app, const uint16_t *records, unsigned int len)
+{
+  unsigned int i;
+  gint64 now = g_get_monotonic_time();
+  gint64 times[DGW_MAX_RECORDS];
+  g_debug("Got %d records", len);
+  app->stats.records += len;
+  timeline_batch(&app->timeline, records, len, app->records_lost, now, times);
+  app->records_lost = FALSE;
+  for (i = 0; i < len; i++) {
+    if (app->timestamps) print_time(timeline_real(&app->timeline, times[i]));
+    print_record(&records[i*2]);
+    //printf(" %04x %04x",records[i*2], records[i*2+1]);
+    dali_state_observe(&app->state, &records[i*2], now);
+    if (app->health) dali_health_observe(app->health, &records[i*2], times[i]);
+    if (app->capture) {
+      GError *err = NULL;
+      if (!capture_writer_add(app->capture,
+			      timeline_real(&app->timeline, times[i]),
+			      &records[i*2], &err)) {
+	g_printerr("%s\n", err->message);
+	g_clear_error(&err);
+      }
+    }
+  }
+  write_state(app, now);
+  if (app->health) write_health(app, now);
+}
+
+static gboolean
+read_sequence(AppContext *app, uint16_t *seq)
+{
+  GError *err = NULL;
+  if (!dgw_device_read_sequence(app->dev, seq, &err)) {
+    g_printerr("%s\n", err->message);
+    g_clear_error(&err);
+    return FALSE;
+  }
+  if (app->keepalive) dgw_keepalive_note(&app->ka, g_get_monotonic_time());
+  return TRUE;
+}
+
+/* Read the records after last_seq up to and including seq. Returns the
+   number of records read or -1 on failure, in which case the caller
+   keeps last_seq and reads them again at the next poll. */
+static int
+read_records(AppContext *app, uint16_t last_seq, uint16_t seq,
+	     uint16_t *records)
+{
+  GError *err = NULL;
+  int len;
+  if ((uint16_t)(seq - last_seq) > DGW_MAX_RECORDS) {
+    app->stats.overruns++;
+    g_printerr("Overrun\n");
+    dgw_trace_dump("overrun", TRUE);
+    app->records_lost = TRUE;
+  }
+  len = dgw_device_read_records(app->dev, last_seq, seq, records, &err);
+  if (len < 0) {
+    g_printerr("%s\n", err->message);
+    g_clear_error(&err);
+  }
+  return len;
+}
+
+/* Read the sequence number, then the new records */
+static void
+poll_sequence(AppContext *app)
+{
+  uint16_t records[DGW_MAX_RECORDS*2];
+  uint16_t seq;
+  int len;
+  if (!read_sequence(app, &seq)) return;
+  if (seq == app->last_seq) {
+    app->stats.empty_polls++;
+    return;
+  }
+  g_debug("Sequence: %d", seq);
+  len = read_records(app, app->last_seq, seq, records);
+  if (len < 0) return;
+  app->last_seq = seq;
+  if (len > 0) handle_records(app, records, len);
+}
+
+/* Read the whole ring and compare it to the previous read. If the new
+   records can't be told from the changes, fall back to reading the
+   sequence number. */
+static void
+poll_snapshot(AppContext *app)
+{
+  uint16_t ring[DGW_RING_REGS];
+  uint16_t records[DGW_MAX_RECORDS*2];
+  unsigned int i;
+  uint16_t seq;
+  int len;
+  GError *err = NULL;
+  if (!dgw_device_read_ring(app->dev, ring, &err)) {
+    g_printerr("%s\n", err->message);
+    g_clear_error(&err);
+    return;
+  }
+  if (app->keepalive) dgw_keepalive_note(&app->ka, g_get_monotonic_time());
+  len = dgw_ring_diff(app->ring, ring, app->last_seq, records);
+  if (len > 0) {
+    memcpy(app->ring, ring, sizeof(ring));
+    app->last_seq += len;
+    app->unchanged_polls = 0;
+    handle_records(app, records, len);
+    return;
+  }
+  if (len == 0 && ++app->unchanged_polls < SNAPSHOT_VERIFY_POLLS) {
+    app->stats.empty_polls++;
+    return;
+  }
+  /* Ambiguous, find out where the ring really is */
+  app->unchanged_polls = 0;
+  app->stats.ambiguous++;
+  memcpy(app->ring, ring, sizeof(ring));
+  if (!read_sequence(app, &seq)) return;
+  if (seq == app->last_seq) {
+    app->stats.empty_polls++;
+    return;
+  }
+  /* The snapshot may be older than the sequence number, so read the
+     records again and update the snapshot with them */
+  len = read_records(app, app->last_seq, seq, records);
+  if (len < 0) return;
+  app->last_seq = seq;
+  if (len > 0) {
+    for (i = 0; i < (unsigned int)len; i++) {
+      unsigned int slot = DGW_RING_SLOT(seq + 1 - len + i);
+      app->ring[slot*2] = records[i*2];
+      app->ring[slot*2+1] = records[i*2+1];
+    }
+    handle_records(app, records, len);
+  }
+}
+
+static gboolean
+command_reply(gpointer data)
+{
+  Command *cmd = data;
+  GString *str = g_string_new("");
+  guint i;
+  if (cmd->error) {
+    g_string_append_printf(str, "error: %s\n", cmd->error->message);
+  } else {
+    for (i = 0; i < cmd->batch->results->len; i++) {
+      const DaliResult *res = &g_array_index(cmd->batch->results,
+					     DaliResult, i);
+      if (res->repeat) continue;
+      dali_result_format(res, str);
+      g_string_append_c(str, '\n');
+    }
+    g_string_append(str, "ok\n");
+  }
+  control_client_reply(cmd->client, str->str);
+  g_string_free(str, TRUE);
+  command_free(cmd);
+  return FALSE;
+}
+
+static void
+command_finish(AppContext *app)
+{
+  Command *cmd = app->command;
+  app->command = NULL;
+  if (!cmd->error) {
+    dali_batch_decode(cmd->send);
+    dali_state_merge(cmd->batch, cmd->send);
+  }
+  g_main_context_invoke(NULL, command_reply, cmd);
+}
+
+/* Number of frames from pos to send as one block. As many as fit in
+   max_time, but at least one frame or send-twice pair. */
+static guint
+command_block_len(AppContext *app, const DaliBatch *batch, guint pos,
+		  gint64 max_time)
+{
+  const uint16_t *frames = &g_array_index(batch->frames, uint16_t, pos);
+  guint left = batch->frames->len - pos;
+  guint n = 0;
+  while (n < left) {
+    guint next = n + 1;
+    if (next < left
+	&& g_array_index(batch->results, DaliResult, pos + next).repeat) {
+      next++;
+    }
+    if (next > DALI_BLOCK_MAX) break;
+    if (n > 0 && dali_timing_predict(dgw_device_timing(app->dev), frames,
+				     next) > max_time) {
+      break;
+    }
+    n = next;
+  }
+  return n;
+}
+
+/* Called right after the ring has been read. Sends the next block of the
+   current command if the bus time budget allows it. Returns TRUE if a
+   block was sent, the ring should then be read again at once. */
+static gboolean
+command_step(AppContext *app, gint64 poll_time)
+{
+  Command *cmd = app->command;
+  gint64 now = g_get_monotonic_time();
+  gint64 predicted;
+  guint n;
+  if (!app->commands) return FALSE;
+  app->command_credit += (now - app->credit_time) * app->control_budget / 100;
+  app->command_credit = MIN(app->command_credit, OVERRUN_TIME);
+  app->credit_time = now;
+  if (!cmd) {
+    cmd = g_async_queue_try_pop(app->commands);
+    if (!cmd) return FALSE;
+    /* With a negative max_age nothing is answered from the table */
+    cmd->send = dali_batch_new();
+    dali_state_resolve(&app->state, cmd->batch, now, cmd->max_age,
+		       cmd->send);
+    app->command = cmd;
+  }
+  if (cmd->pos == cmd->send->frames->len) {
+    command_finish(app);
+    return FALSE;
+  }
+  n = command_block_len(app, cmd->send, cmd->pos,
+			COMMAND_BLOCK_TIME - (now - poll_time));
+  predicted = dali_timing_predict(dgw_device_timing(app->dev),
+				  &g_array_index(cmd->send->frames, uint16_t,
+						 cmd->pos), n);
+  if (app->command_credit < predicted && app->command_credit < OVERRUN_TIME) {
+    return FALSE;
+  }
+  if (dgw_device_send_block(app->dev,
+			    &g_array_index(cmd->send->frames, uint16_t,
+					   cmd->pos),
+			    &g_array_index(cmd->send->replies, uint16_t,
+					   cmd->pos),
+			    n, &cmd->error)) {
+    cmd->pos += n;
+    if (app->keepalive) dgw_keepalive_note(&app->ka, g_get_monotonic_time());
+  }
+  app->command_credit -= g_get_monotonic_time() - now;
+  if (cmd->error || cmd->pos == cmd->send->frames->len) {
+    command_finish(app);
+  }
+  return TRUE;
+}
+
 static gpointer 
 modbus_poll(gpointer data)
 {
-  uint16_t records[MAX_RECORDS*2];
-  int r;
-  uint16_t last_seq;
+  gint64 next_poll;
   AppContext *app = data;
+  GError *err = NULL;
   g_mutex_lock(&app->mb_mutex);
   app->mb_thread_running = TRUE;
   g_cond_signal(&app->mb_cond);
   g_mutex_unlock(&app->mb_mutex);
   g_debug("Thread running");
-  r = modbus_read_input_registers(app->mb, MB_ADDR_SEQUENCE, 1, &last_seq);
-  if (r == 1) {
-    g_debug("Start: %d", last_seq);
+  timeline_polled(&app->timeline, g_get_monotonic_time());
+  if (dgw_device_read_sequence(app->dev, &app->last_seq, &err)) {
+    g_debug("Start: %d", app->last_seq);
   } else {
-    g_printerr("Failed to read first sequece number: %s", 
-	       modbus_strerror(errno));
+    g_printerr("%s\n", err->message);
+    g_clear_error(&err);
+  }
+  if (app->poll_mode == POLL_SNAPSHOT) {
+    /* Initial contents to compare with */
+    if (!dgw_device_read_ring(app->dev, app->ring, &err)) {
+      g_printerr("%s\n", err->message);
+      g_clear_error(&err);
+    }
+  }
+  if (app->keepalive) {
+    gboolean ok = dgw_keepalive_setup(&app->ka, dgw_device_lock(app->dev),
+				      &err);
+    dgw_device_unlock(app->dev);
+    if (!ok) {
+      g_printerr("Keepalive disabled: %s\n", err->message);
+      g_clear_error(&err);
+      app->keepalive = FALSE;
+    }
   }
-  modbus_flush(app->mb);
+  next_poll = g_get_monotonic_time() + POLL_INTERVAL;
+  app->credit_time = g_get_monotonic_time();
   while(app->mb_thread_running) {
-    uint16_t seq;
-    g_usleep(G_USEC_PER_SEC/10);
-    r = modbus_read_input_registers(app->mb, MB_ADDR_SEQUENCE, 1, &seq);
-    if (r == 1) {
-      if (seq != last_seq) {
-	uint16_t start;
-	uint16_t end;
-	uint16_t len;
-	g_debug("Sequence: %d", seq);
-	len = seq - last_seq;
-	if (len > MAX_RECORDS) {
-	  len = MAX_RECORDS;
-	  g_printerr("Overrun");
-	}
-	end = seq + 1;
-	start = (end - len) & 0x1f;
-	end &= 0x1f;
-	start *= 2;
-	end *=2;
-	g_debug("%d - %d",start, end);
-	if (start < end) {
-	  r = modbus_read_input_registers(app->mb,
-					  MB_ADDR_RECORDS+start, end - start,
-					  records);
-	} else {
-	  r = modbus_read_input_registers(app->mb, MB_ADDR_RECORDS+start, 
-					  64 - start, records);
-	  if (r > 0 && end > 0) {
-	    r = modbus_read_input_registers(app->mb, MB_ADDR_RECORDS,
-					    end, records+(64 - start));
-	  }
-	}
-	if (r > 0) {
-	  unsigned int i;
-	  g_debug("Got %d records", len);
-	  for (i = 0; i < len; i++) {
-	    print_record(&records[i*2]);
-	    //printf(" %04x %04x",records[i*2], records[i*2+1]);
-	  }
-	} else {
-	  g_printerr("Failed to read records: %s\n", modbus_strerror(errno));
+    gint64 now = g_get_monotonic_time();
+    gint64 wake = next_poll;
+    gint64 poll_start;
+    guint64 transactions;
+    if (app->keepalive) wake = MIN(wake, dgw_keepalive_next(&app->ka));
+    if (wake > now) {
+      g_usleep(wake - now);
+      now = g_get_monotonic_time();
+    }
+    if (now < next_poll) {
+      /* Woke up early, only the keepalive has something to do */
+      if (app->keepalive) {
+	gboolean ok = dgw_keepalive_poll(&app->ka, dgw_device_lock(app->dev),
+					 now, &err);
+	dgw_device_unlock(app->dev);
+	if (!ok) {
+	  g_printerr("Keepalive failed: %s\n", err->message);
+	  g_clear_error(&err);
 	}
-	
-	  
-	last_seq = seq;
       }
+      continue;
+    }
+    next_poll = now + POLL_INTERVAL;
+    app->stats.polls++;
+    /* Keep the port to ourselves from the poll to the command block */
+    dgw_device_lock(app->dev);
+    transactions = dgw_device_transactions(app->dev);
+    poll_start = g_get_monotonic_time();
+    if (app->poll_mode == POLL_SNAPSHOT) {
+      poll_snapshot(app);
     } else {
-      g_printerr("Failed to read sequece number\n");
+      poll_sequence(app);
+    }
+    timeline_polled(&app->timeline, poll_start);
+    app->stats.transactions +=
+      dgw_device_transactions(app->dev) - transactions;
+    if (command_step(app, now)) {
+      next_poll = g_get_monotonic_time();
+    }
+    dgw_device_unlock(app->dev);
+    if (app->capture
+	&& !capture_writer_commit(app->capture, g_get_real_time(), &err)) {
+      g_printerr("%s\n", err->message);
+      g_clear_error(&err);
     }
-    modbus_flush(app->mb);
   }
   g_debug("Thread exiting");
   return NULL;
@@ -170,17 +688,32 @@ stop_mb_thread(AppContext *app)
 static gboolean
 init_modbus(AppContext *app)
 {
-  app->mb = modbus_new_rtu(app->device, app->speed, 'N', 8, 1);
-  if (!app->mb) {
-    g_printerr("Failed to create Modbus context\n");
-    return FALSE;
+  GError *err = NULL;
+  if (app->capture_prefix) {
+    app->capture = capture_writer_new(app->capture_prefix,
+				      (guint64)app->rotate_size << 20,
+				      (gint64)app->rotate_time * G_USEC_PER_SEC,
+				      &err);
+    if (!app->capture) {
+      g_printerr("%s\n", err->message);
+      g_clear_error(&err);
+      return FALSE;
+    }
+    capture_writer_set_intervals(app->capture,
+				 (gint64)app->commit_interval * 1000,
+				 (gint64)app->sync_interval * 1000);
   }
-  modbus_set_debug(app->mb, app->debug);
-  modbus_set_slave(app->mb,1);
-  if (modbus_connect(app->mb)) {
-    g_printerr("Failed to connect: %s\n",modbus_strerror(errno));
+  if (app->control_path) {
+    app->commands = g_async_queue_new();
+  }
+  app->dev = dgw_device_open(app->device, app->speed, 'N', app->mb_addr,
+			     &err);
+  if (!app->dev) {
+    g_printerr("%s\n", err->message);
+    g_clear_error(&err);
     return FALSE;
   }
+  dgw_device_set_debug(app->dev, app->debug);
   
   app->mb_thread = g_thread_new("Modbus", modbus_poll, app);
   g_mutex_lock(&app->mb_mutex);
@@ -193,6 +726,51 @@ init_modbus(AppContext *app)
   return TRUE;
 }
 
+/* Each line is a list of commands in the dgw521_send syntax, optionally
+   starting with cache=MS */
+static void
+control_line(ControlClient *client, const gchar *line, gpointer user_data)
+{
+  AppContext *app = user_data;
+  GError *err = NULL;
+  gchar **args = g_strsplit_set(line, " \t", -1);
+  Command *cmd = g_new0(Command, 1);
+  gboolean first = TRUE;
+  guint i;
+  cmd->batch = dali_batch_new();
+  cmd->max_age = -1;
+  for (i = 0; args[i] && !err; i++) {
+    /* Repeated or leading separators give empty tokens */
+    if (*args[i] == '\0') continue;
+    if (first && g_str_has_prefix(args[i], "cache=")) {
+      gchar *end;
+      gint64 ms = g_ascii_strtoll(args[i] + 6, &end, 10);
+      if (*end != '\0' || end == args[i] + 6 || ms < 0) {
+	g_set_error(&err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		    "Invalid cache age %s", args[i] + 6);
+      }
+      cmd->max_age = ms * 1000;
+    } else {
+      dali_batch_parse(cmd->batch, args[i], &err);
+    }
+    first = FALSE;
+  }
+  g_strfreev(args);
+  if (!err && g_async_queue_length(app->commands) >= COMMAND_QUEUE_MAX) {
+    g_set_error(&err, DGW_ERROR, DGW_ERROR_BUSY, "Too many commands queued");
+  }
+  if (err) {
+    gchar *reply = g_strdup_printf("error: %s\n", err->message);
+    control_client_reply(client, reply);
+    g_free(reply);
+    g_clear_error(&err);
+    command_free(cmd);
+    return;
+  }
+  cmd->client = control_client_ref(client);
+  g_async_queue_push(app->commands, cmd);
+}
+
 static gboolean
 sigint_handler(gpointer user_data)
 {
@@ -211,6 +789,38 @@ const GOptionEntry app_options[] = {
    &app.mb_addr, "Modbus address of DGW-521", "ADDR"},
   {"decode", 0, 0, G_OPTION_ARG_NONE,
    &app.decode, "Decode packets", NULL},
+  {"timestamps", 0, 0, G_OPTION_ARG_NONE,
+   &app.timestamps, "Print the reconstructed time of each record", NULL},
+  {"poll-mode", 0, 0, G_OPTION_ARG_STRING,
+   &app.poll_mode_str, "How to poll the record ring (snapshot needs at least "
+   "38400 bps, a ring read takes 77 ms at 19200)", "sequence|snapshot"},
+  {"state-file", 0, 0, G_OPTION_ARG_FILENAME,
+   &app.state_file, "Keep cached DALI device state in FILE", "FILE"},
+  {"health-file", 0, 0, G_OPTION_ARG_FILENAME,
+   &app.health_file, "Track error rates per address and report them in FILE",
+   "FILE"},
+  {"keepalive", 0, 0, G_OPTION_ARG_NONE,
+   &app.keepalive, "Keep the gateway watchdog fed and report trips", NULL},
+  {"capture", 0, 0, G_OPTION_ARG_FILENAME,
+   &app.capture_prefix, "Write compressed capture files named PREFIX-TIME",
+   "PREFIX"},
+  {"rotate-size", 0, 0, G_OPTION_ARG_INT,
+   &app.rotate_size, "Start a new capture file after MB megabytes", "MB"},
+  {"rotate-time", 0, 0, G_OPTION_ARG_INT,
+   &app.rotate_time, "Start a new capture file after SEC seconds", "SEC"},
+  {"commit-interval", 0, 0, G_OPTION_ARG_INT,
+   &app.commit_interval, "Write captured records at least every MS ms "
+   "(default 1000, 0 after every poll)", "MS"},
+  {"sync-interval", 0, 0, G_OPTION_ARG_INT,
+   &app.sync_interval, "Sync capture files to disk every MS ms "
+   "(default 5000)", "MS"},
+  {"control", 0, 0, G_OPTION_ARG_FILENAME,
+   &app.control_path, "Accept DALI commands on a Unix socket at PATH", "PATH"},
+  {"control-budget", 0, 0, G_OPTION_ARG_INT,
+   &app.control_budget, "Share of the time used for commands (default 50)",
+   "PERCENT"},
+  {"trace", 0, 0, G_OPTION_ARG_FILENAME,
+   &app.trace_file, "Dump the Modbus transaction trace to FILE", "FILE"},
   {"debug", 0, 0, G_OPTION_ARG_NONE, &app.debug,
    "Turn on Modbus debugging", NULL},
   {NULL}
@@ -231,10 +841,44 @@ main(int argc, char **argv)
     return EXIT_FAILURE;
   }
   g_option_context_free(opt_ctxt);
+  dgw_trace_init(app.trace_file);
+  if (app.poll_mode_str) {
+    if (strcmp(app.poll_mode_str, "snapshot") == 0) {
+      app.poll_mode = POLL_SNAPSHOT;
+      if (app.speed == 0 || RING_READ_TIME(app.speed) > POLL_INTERVAL / 2) {
+	g_printerr("Snapshot mode is too slow at %u bps\n", app.speed);
+	app_cleanup(&app);
+	return EXIT_FAILURE;
+      }
+    } else if (strcmp(app.poll_mode_str, "sequence") != 0) {
+      g_printerr("Invalid poll mode %s\n", app.poll_mode_str);
+      app_cleanup(&app);
+      return EXIT_FAILURE;
+    }
+  }
+  if (app.health_file) {
+    app.health = g_new(DaliHealth, 1);
+    dali_health_init(app.health, health_alert, &app);
+  }
+  if (app.control_budget < 1 || app.control_budget > 100) {
+    g_printerr("Control budget must be 1-100%%\n");
+    app_cleanup(&app);
+    return EXIT_FAILURE;
+  }
   if (!init_modbus(&app)) {
     app_cleanup(&app);
     return EXIT_FAILURE;
   }
+  if (app.control_path) {
+    app.control = control_server_new(app.control_path, control_line, &app,
+				     &err);
+    if (!app.control) {
+      g_printerr("%s\n", err->message);
+      g_clear_error(&err);
+      app_cleanup(&app);
+      return EXIT_FAILURE;
+    }
+  }
   
   loop = g_main_loop_new(NULL, FALSE);
   g_unix_signal_add(SIGINT, sigint_handler, loop);
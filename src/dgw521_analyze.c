@@ -0,0 +1,631 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include "dgw_error.h"
+#include "dali_cmd.h"
+#include "dali_record.h"
+#include "capture.h"
+
+/* Targets of forward frames, as indexes into the per-target counters */
+#define TARGET_GROUP DALI_SHORT_ADDR_COUNT
+#define TARGET_BROADCAST (TARGET_GROUP + DALI_GROUP_COUNT)
+#define TARGET_SPECIAL (TARGET_BROADCAST + 1)
+#define N_TARGETS (TARGET_SPECIAL + 1)
+
+/* Latency histogram, 2ms per bin */
+#define LATENCY_BIN_MS 2
+#define LATENCY_BINS 64
+
+#define HOUR (3600 * (gint64)G_USEC_PER_SEC)
+/* Length of the hourly table, a year from the first hour. Later records
+   are only counted in the totals. */
+#define HOUR_SLOTS (366 * 24)
+
+typedef struct HourStats HourStats;
+struct HourStats
+{
+  guint64 records;
+  guint64 errors;
+};
+
+/* Aggregates for one worker, all fixed size */
+typedef struct Stats Stats;
+struct Stats
+{
+  guint64 records;
+  guint64 forward;
+  guint64 backward;
+  guint64 errors;
+  guint64 target_frames[N_TARGETS];
+  guint64 answers[DALI_SHORT_ADDR_COUNT];
+  guint64 unanswered[DALI_SHORT_ADDR_COUNT];
+  guint64 latency[DALI_SHORT_ADDR_COUNT][LATENCY_BINS + 1];
+  guint32 frame_counts[0x10000];
+  HourStats hours[HOUR_SLOTS]; /* From AppContext.first_hour */
+  guint64 hours_skipped; /* Records outside the hourly table */
+};
+
+/* Each worker owns a contiguous slice of the selected blocks. Owners and
+   thieves both take items from the front of a slice, so claiming an item
+   is a single atomic add. */
+typedef struct WorkQueue WorkQueue;
+struct WorkQueue
+{
+  volatile gint next;
+  gint end;
+};
+
+typedef struct AppContext AppContext;
+struct AppContext
+{
+  gchar *from_str;
+  gchar *to_str;
+  gint addr;
+  gint group;
+  gboolean list;
+  gint top;
+  gint threads;
+
+  gint64 from;
+  gint64 to;
+  gint64 first_hour;
+  /* Files are analyzed one at a time, items are the selected blocks of
+     the current one */
+  CaptureFile *file;
+  GArray *items;
+  WorkQueue *queues;
+  guint n_workers;
+};
+
+typedef struct Worker Worker;
+struct Worker
+{
+  AppContext *app;
+  guint index;
+  Stats stats;
+  CaptureRecord records[CAPTURE_BLOCK_RECORDS];
+};
+
+static void
+app_init(AppContext *app)
+{
+  app->from_str = NULL;
+  app->to_str = NULL;
+  app->addr = -1;
+  app->group = -1;
+  app->list = FALSE;
+  app->top = 10;
+  app->threads = 0;
+  app->from = G_MININT64;
+  app->to = G_MAXINT64;
+  app->first_hour = G_MININT64;
+  app->file = NULL;
+  app->items = g_array_new(FALSE, FALSE, sizeof(guint));
+  app->queues = NULL;
+  app->n_workers = 0;
+}
+
+static void
+app_cleanup(AppContext *app)
+{
+  g_free(app->queues);
+  g_array_free(app->items, TRUE);
+  capture_file_close(app->file);
+  g_free(app->from_str);
+  g_free(app->to_str);
+}
+
+static void
+add_hour(const AppContext *app, Stats *stats, gint64 hour, guint64 records,
+	 guint64 errors)
+{
+  gint64 slot = (hour - app->first_hour) / HOUR;
+  if (hour < app->first_hour || slot >= HOUR_SLOTS) {
+    stats->hours_skipped += records;
+    return;
+  }
+  stats->hours[slot].records += records;
+  stats->hours[slot].errors += errors;
+}
+
+/* Start of the local time hour containing time. The hours are printed
+   in local time, so they must be cut in local time too, not every zone
+   is a whole number of hours from UTC. */
+static gint64
+local_hour(gint64 time)
+{
+  time_t secs = time / G_USEC_PER_SEC;
+  struct tm tm;
+  localtime_r(&secs, &tm);
+  tm.tm_min = 0;
+  tm.tm_sec = 0;
+  return (gint64)mktime(&tm) * G_USEC_PER_SEC;
+}
+
+static guint
+frame_target(uint16_t frame)
+{
+  guint8 a = frame >> 8;
+  if (a < 0x80) return a >> 1;
+  if (a < 0xa0) return TARGET_GROUP + ((a >> 1) & 0x0f);
+  if (a >= 0xfe) return TARGET_BROADCAST;
+  return TARGET_SPECIAL;
+}
+
+static gboolean
+target_selected(const AppContext *app, guint target)
+{
+  if (app->addr >= 0 && target != (guint)app->addr) return FALSE;
+  if (app->group >= 0 && target != (guint)(TARGET_GROUP + app->group)) {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* Walk the records of one block. Backward frames are attributed to the
+   query before them. A query at the end of a block is not paired with an
+   answer at the start of the next one. */
+static void
+analyze_block(const AppContext *app, Stats *stats,
+	      const CaptureRecord *records, guint n)
+{
+  guint i;
+  gint query_addr = -1;
+  guint target = TARGET_SPECIAL;
+  gint64 hour = G_MAXINT64;
+  guint64 hour_records = 0;
+  guint64 hour_errors = 0;
+  for (i = 0; i < n; i++) {
+    const CaptureRecord *r = &records[i];
+    gboolean error = DALI_RECORD_IS_ERROR(r->rec);
+    gint pending = query_addr;
+    if (r->time < app->from || r->time >= app->to) continue;
+    query_addr = -1;
+    if (DALI_RECORD_IS_FORWARD(r->rec)) {
+      target = frame_target(r->rec[0]);
+      if (!error && target < DALI_SHORT_ADDR_COUNT
+	  && dali_frame_is_query(r->rec[0])) {
+	query_addr = target;
+      }
+    }
+    if (pending >= 0 && target_selected(app, pending)) {
+      guint ms = DALI_RECORD_DELAY(r->rec);
+      if (DALI_RECORD_IS_ANSWER(r->rec)) {
+	guint bin = MIN(ms / LATENCY_BIN_MS, LATENCY_BINS);
+	stats->answers[pending]++;
+	stats->latency[pending][bin]++;
+      } else {
+	stats->unanswered[pending]++;
+      }
+    }
+    if (!target_selected(app, target)) continue;
+    if (r->time < hour || r->time >= hour + HOUR) {
+      if (hour_records > 0) {
+	add_hour(app, stats, hour, hour_records, hour_errors);
+      }
+      hour = local_hour(r->time);
+      hour_records = 0;
+      hour_errors = 0;
+    }
+    hour_records++;
+    stats->records++;
+    if (error) {
+      hour_errors++;
+      stats->errors++;
+    }
+    if (DALI_RECORD_IS_FORWARD(r->rec)) {
+      stats->forward++;
+      stats->target_frames[target]++;
+      stats->frame_counts[r->rec[0]]++;
+    } else {
+      stats->backward++;
+    }
+  }
+  if (hour_records > 0) add_hour(app, stats, hour, hour_records, hour_errors);
+}
+
+static gboolean
+claim_item(WorkQueue *queue, gint *item)
+{
+  if (g_atomic_int_get(&queue->next) >= queue->end) return FALSE;
+  *item = g_atomic_int_add(&queue->next, 1);
+  return *item < queue->end;
+}
+
+static gpointer
+worker_run(gpointer data)
+{
+  Worker *worker = data;
+  AppContext *app = worker->app;
+  guint victim = worker->index;
+  guint tried = 0;
+  /* Start with our own queue, then steal from the others in turn */
+  while (tried < app->n_workers) {
+    gint item;
+    guint block;
+    const CaptureBlockInfo *info;
+    GError *err = NULL;
+    if (!claim_item(&app->queues[victim], &item)) {
+      victim = (victim + 1) % app->n_workers;
+      tried++;
+      continue;
+    }
+    block = g_array_index(app->items, guint, item);
+    info = &g_array_index(app->file->blocks, CaptureBlockInfo, block);
+    if (!capture_file_decode(app->file, block, worker->records, &err)) {
+      g_printerr("%s\n", err->message);
+      g_clear_error(&err);
+      continue;
+    }
+    analyze_block(app, &worker->stats, worker->records, info->n_records);
+  }
+  return NULL;
+}
+
+static void
+merge_stats(Stats *to, const Stats *from)
+{
+  guint a;
+  guint b;
+  to->records += from->records;
+  to->forward += from->forward;
+  to->backward += from->backward;
+  to->errors += from->errors;
+  for (a = 0; a < N_TARGETS; a++) {
+    to->target_frames[a] += from->target_frames[a];
+  }
+  for (a = 0; a < DALI_SHORT_ADDR_COUNT; a++) {
+    to->answers[a] += from->answers[a];
+    to->unanswered[a] += from->unanswered[a];
+    for (b = 0; b <= LATENCY_BINS; b++) {
+      to->latency[a][b] += from->latency[a][b];
+    }
+  }
+  for (a = 0; a < 0x10000; a++) {
+    to->frame_counts[a] += from->frame_counts[a];
+  }
+  for (a = 0; a < HOUR_SLOTS; a++) {
+    to->hours[a].records += from->hours[a].records;
+    to->hours[a].errors += from->hours[a].errors;
+  }
+  to->hours_skipped += from->hours_skipped;
+}
+
+static void
+format_target(guint target, GString *str)
+{
+  if (target < TARGET_GROUP) {
+    g_string_append_printf(str, "%d", target);
+  } else if (target < TARGET_BROADCAST) {
+    g_string_append_printf(str, "g%d", target - TARGET_GROUP);
+  } else if (target == TARGET_BROADCAST) {
+    g_string_append(str, "bc");
+  } else {
+    g_string_append(str, "special");
+  }
+}
+
+static guint
+percentile(const guint64 *hist, guint64 total, guint pct)
+{
+  guint64 sum = 0;
+  guint b;
+  for (b = 0; b <= LATENCY_BINS; b++) {
+    sum += hist[b];
+    if (sum * 100 >= total * pct) break;
+  }
+  return b * LATENCY_BIN_MS;
+}
+
+static void
+print_report(const AppContext *app, Stats *stats)
+{
+  GString *str = g_string_new("");
+  guint i;
+  printf("Records: %" G_GUINT64_FORMAT " (forward %" G_GUINT64_FORMAT
+	 ", backward %" G_GUINT64_FORMAT ", errors %" G_GUINT64_FORMAT ")\n",
+	 stats->records, stats->forward, stats->backward, stats->errors);
+
+  printf("\nFrames per target:\n");
+  for (i = 0; i < N_TARGETS; i++) {
+    if (stats->target_frames[i] == 0) continue;
+    g_string_truncate(str, 0);
+    format_target(i, str);
+    printf("%8s %" G_GUINT64_FORMAT "\n", str->str, stats->target_frames[i]);
+  }
+
+  printf("\nErrors per hour:\n");
+  for (i = 0; i < HOUR_SLOTS; i++) {
+    const HourStats *h = &stats->hours[i];
+    time_t secs;
+    char stamp[32];
+    if (h->records == 0) continue;
+    secs = (app->first_hour + i * HOUR) / G_USEC_PER_SEC;
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:00", localtime(&secs));
+    printf("%s %8" G_GUINT64_FORMAT "/%-8" G_GUINT64_FORMAT " %.3f%%\n",
+	   stamp, h->errors, h->records, 100.0 * h->errors / h->records);
+  }
+  if (stats->hours_skipped > 0) {
+    printf("%" G_GUINT64_FORMAT " records more than %d days after the first"
+	   " hour not shown\n", stats->hours_skipped, HOUR_SLOTS / 24);
+  }
+
+  printf("\nQuery latency per address (ms):\n");
+  for (i = 0; i < DALI_SHORT_ADDR_COUNT; i++) {
+    guint64 n = stats->answers[i];
+    if (n == 0 && stats->unanswered[i] == 0) continue;
+    printf("%8d answered %" G_GUINT64_FORMAT ", unanswered %"
+	   G_GUINT64_FORMAT, i, n, stats->unanswered[i]);
+    if (n > 0) {
+      printf(", p50 %d, p90 %d, p99 %d",
+	     percentile(stats->latency[i], n, 50),
+	     percentile(stats->latency[i], n, 90),
+	     percentile(stats->latency[i], n, 99));
+    }
+    printf("\n");
+  }
+
+  printf("\nTop %d frames:\n", app->top);
+  for (i = 0; i < (guint)app->top; i++) {
+    guint f;
+    guint best = 0;
+    for (f = 1; f < 0x10000; f++) {
+      if (stats->frame_counts[f] > stats->frame_counts[best]) best = f;
+    }
+    if (stats->frame_counts[best] == 0) break;
+    printf("    %04x %u\n", best, stats->frame_counts[best]);
+    stats->frame_counts[best] = 0;
+  }
+  g_string_free(str, TRUE);
+}
+
+/* Print the selected records of the current file in order. This streams
+   through the blocks on the calling thread. */
+static void
+list_records(const AppContext *app)
+{
+  CaptureRecord *records = g_new(CaptureRecord, CAPTURE_BLOCK_RECORDS);
+  guint i;
+  for (i = 0; i < app->items->len; i++) {
+    guint block = g_array_index(app->items, guint, i);
+    const CaptureBlockInfo *info =
+      &g_array_index(app->file->blocks, CaptureBlockInfo, block);
+    GError *err = NULL;
+    guint target = TARGET_SPECIAL;
+    guint r;
+    if (!capture_file_decode(app->file, block, records, &err)) {
+      g_printerr("%s\n", err->message);
+      g_clear_error(&err);
+      continue;
+    }
+    for (r = 0; r < info->n_records; r++) {
+      const CaptureRecord *rec = &records[r];
+      time_t secs = rec->time / G_USEC_PER_SEC;
+      char stamp[32];
+      if (DALI_RECORD_IS_FORWARD(rec->rec)) target = frame_target(rec->rec[0]);
+      if (rec->time < app->from || rec->time >= app->to
+	  || !target_selected(app, target)) {
+	continue;
+      }
+      strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+      printf("%s.%06d ", stamp, (int)(rec->time % G_USEC_PER_SEC));
+      if (DALI_RECORD_IS_FORWARD(rec->rec)) {
+	printf("%04x", rec->rec[0]);
+      } else {
+	printf("  %02x", rec->rec[0]);
+      }
+      if (rec->rec[1] & 0x02) printf(" Incorrect data");
+      if (rec->rec[1] & 0x04) printf(" Incorrect start bit");
+      printf("\n");
+    }
+  }
+  g_free(records);
+}
+
+/* Accepts "YYYY-MM-DD[ HH:MM[:SS]]" in local time or "@SECONDS" */
+static gboolean
+parse_time(const gchar *str, gint64 *time, GError **err)
+{
+  static const char *formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M",
+				  "%Y-%m-%d", NULL};
+  struct tm tm;
+  unsigned int f;
+  if (str[0] == '@') {
+    char *end;
+    *time = g_ascii_strtoll(str + 1, &end, 10) * G_USEC_PER_SEC;
+    if (end != str + 1 && *end == '\0') return TRUE;
+  }
+  for (f = 0; formats[f]; f++) {
+    const char *end;
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(str, formats[f], &tm);
+    if (end && *end == '\0') {
+      tm.tm_isdst = -1;
+      *time = (gint64)mktime(&tm) * G_USEC_PER_SEC;
+      return TRUE;
+    }
+  }
+  g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER, "Invalid time %s", str);
+  return FALSE;
+}
+
+static gint
+compare_names(gconstpointer a, gconstpointer b)
+{
+  return strcmp(*(const gchar**)a, *(const gchar**)b);
+}
+
+/* Collect capture files from the arguments, directories are searched
+   for files with the capture suffix. */
+static void
+collect_paths(int argc, char **argv, GPtrArray *paths)
+{
+  int a;
+  for (a = 1; a < argc; a++) {
+    if (g_file_test(argv[a], G_FILE_TEST_IS_DIR)) {
+      const gchar *name;
+      GDir *dir = g_dir_open(argv[a], 0, NULL);
+      if (!dir) continue;
+      while ((name = g_dir_read_name(dir))) {
+	if (g_str_has_suffix(name, CAPTURE_FILE_SUFFIX)) {
+	  g_ptr_array_add(paths, g_build_filename(argv[a], name, NULL));
+	}
+      }
+      g_dir_close(dir);
+    } else {
+      g_ptr_array_add(paths, g_strdup(argv[a]));
+    }
+  }
+  g_ptr_array_sort(paths, compare_names);
+}
+
+/* Select the blocks of the current file that overlap the time range. The
+   hourly table starts at the first selected hour unless --from is
+   given. */
+static void
+select_blocks(AppContext *app)
+{
+  const CaptureFile *file = app->file;
+  guint b;
+  g_array_set_size(app->items, 0);
+  for (b = capture_file_find(file, app->from); b < file->blocks->len; b++) {
+    const CaptureBlockInfo *info =
+      &g_array_index(file->blocks, CaptureBlockInfo, b);
+    if (info->first_time >= app->to) break;
+    if (app->first_hour == G_MININT64) {
+      app->first_hour = local_hour(info->first_time);
+    }
+    g_array_append_val(app->items, b);
+  }
+}
+
+/* Analyze the selected blocks of the current file. The workers keep
+   their statistics from file to file. */
+static void
+run_workers(AppContext *app, Worker *workers, guint n_max)
+{
+  GThread **threads;
+  guint n = CLAMP(app->items->len, 1, n_max);
+  guint w;
+  app->n_workers = n;
+  for (w = 0; w < n; w++) {
+    app->queues[w].next = app->items->len * w / n;
+    app->queues[w].end = app->items->len * (w + 1) / n;
+  }
+  threads = g_new(GThread*, n);
+  for (w = 0; w < n; w++) {
+    threads[w] = g_thread_new("Worker", worker_run, &workers[w]);
+  }
+  for (w = 0; w < n; w++) {
+    g_thread_join(threads[w]);
+  }
+  g_free(threads);
+}
+
+/* Open the files one at a time, in name order which is time order, and
+   list or analyze them. Only one file is mapped at a time. */
+static void
+process_files(AppContext *app, GPtrArray *paths, Worker *workers,
+	      guint n_workers)
+{
+  guint p;
+  for (p = 0; p < paths->len; p++) {
+    const gchar *path = g_ptr_array_index(paths, p);
+    GError *err = NULL;
+    app->file = capture_file_open(path, &err);
+    if (!app->file) {
+      g_printerr("%s\n", err->message);
+      g_clear_error(&err);
+      continue;
+    }
+    select_blocks(app);
+    g_debug("%s: %u blocks selected", path, app->items->len);
+    if (app->items->len > 0) {
+      if (workers) {
+	run_workers(app, workers, n_workers);
+      } else {
+	list_records(app);
+      }
+    }
+    capture_file_close(app->file);
+    app->file = NULL;
+  }
+}
+
+AppContext app;
+
+const GOptionEntry app_options[] = {
+  {"from", 0, 0, G_OPTION_ARG_STRING,
+   &app.from_str, "Only records at or after TIME", "TIME"},
+  {"to", 0, 0, G_OPTION_ARG_STRING,
+   &app.to_str, "Only records before TIME", "TIME"},
+  {"addr", 0, 0, G_OPTION_ARG_INT,
+   &app.addr, "Only frames to short address ADDR", "ADDR"},
+  {"group", 0, 0, G_OPTION_ARG_INT,
+   &app.group, "Only frames to group GROUP", "GROUP"},
+  {"list", 0, 0, G_OPTION_ARG_NONE,
+   &app.list, "List the selected records instead of summarizing", NULL},
+  {"top", 0, 0, G_OPTION_ARG_INT,
+   &app.top, "Number of most frequent frames to show", "N"},
+  {"threads", 'j', 0, G_OPTION_ARG_INT,
+   &app.threads, "Number of worker threads", "N"},
+  {NULL}
+};
+
+int
+main(int argc, char **argv)
+{
+  GError *err = NULL;
+  GOptionContext *opt_ctxt;
+  GPtrArray *paths;
+  app_init(&app);
+  opt_ctxt = g_option_context_new ("FILE|DIR... - analyze DALI captures");
+  g_option_context_add_main_entries(opt_ctxt, app_options, NULL);
+  if (!g_option_context_parse(opt_ctxt, &argc, &argv, &err)) {
+    g_printerr("Failed to parse options: %s\n", err->message);
+    app_cleanup(&app);
+    return EXIT_FAILURE;
+  }
+  g_option_context_free(opt_ctxt);
+  if ((app.from_str && !parse_time(app.from_str, &app.from, &err))
+      || (app.to_str && !parse_time(app.to_str, &app.to, &err))) {
+    g_printerr("%s\n", err->message);
+    g_clear_error(&err);
+    app_cleanup(&app);
+    return EXIT_FAILURE;
+  }
+  if (app.addr >= DALI_SHORT_ADDR_COUNT || app.group >= DALI_GROUP_COUNT) {
+    g_printerr("Invalid address or group\n");
+    app_cleanup(&app);
+    return EXIT_FAILURE;
+  }
+
+  if (app.from != G_MININT64) app.first_hour = local_hour(app.from);
+
+  paths = g_ptr_array_new_with_free_func(g_free);
+  collect_paths(argc, argv, paths);
+  if (app.list) {
+    process_files(&app, paths, NULL, 0);
+  } else {
+    guint n = app.threads > 0 ? (guint)app.threads : g_get_num_processors();
+    Worker *workers = g_new0(Worker, n);
+    Stats *total = g_new0(Stats, 1);
+    guint w;
+    app.queues = g_new(WorkQueue, n);
+    for (w = 0; w < n; w++) {
+      workers[w].app = &app;
+      workers[w].index = w;
+    }
+    process_files(&app, paths, workers, n);
+    for (w = 0; w < n; w++) merge_stats(total, &workers[w].stats);
+    print_report(&app, total);
+    g_free(total);
+    g_free(workers);
+  }
+  g_ptr_array_free(paths, TRUE);
+  app_cleanup(&app);
+  return EXIT_SUCCESS;
+}
@@ -4,26 +4,11 @@
 #include <stdint.h>
 #include <glib.h>
 #include <glib-unix.h>
-#include <modbus-rtu.h>
+#include "dgw_error.h"
+#include "dgw_trace.h"
+#include "dali_cmd.h"
+#include "dgw_device.h"
 
-GQuark
-dgw_error_quark()
-{
-  static GQuark error_quark = 0;
-  if (error_quark == 0)
-    error_quark =
-      g_quark_from_static_string ("DGW-521-error-quark");
-  return error_quark;
-}
-
-#define DGW_ERROR (dgw_error_quark())
-enum {
-  DGW_ERROR_OK = 0,
-  DGW_ERROR_READ,
-  DGW_ERROR_WRITE,
-  DGW_ERROR_PARAMETER
-};
-  
 typedef struct ModbusSource ModbusSource;
 struct ModbusSource {
   GSource source;
@@ -37,13 +22,12 @@ struct AppContext
   guint speed;
   guint mb_addr;
   gboolean debug;
+  gchar *trace_file;
 
   
-  modbus_t *mb;
+  DgwDevice *dev;
 
-  uint16_t n_cmds;
-  uint16_t *cmds;
-  uint16_t *replies;
+  DaliBatch *batch;
 };
 
 
@@ -54,57 +38,33 @@ app_init(AppContext *app)
   app->speed = 38400;
   app->mb_addr = 1;
   app->debug = 0;
-  app->cmds = NULL;
-  app->replies = NULL;
-  app->n_cmds = 0;
+  app->trace_file = NULL;
+  app->batch = NULL;
+  app->dev = NULL;
 }
 
 static void
 app_cleanup(AppContext* app)
 {
-  g_free(app->cmds);
-  g_free(app->replies);
-  if (app->mb) {
-    modbus_close(app->mb);
-    modbus_free(app->mb);
-    app->mb = NULL;
-  }
+  dali_batch_free(app->batch);
+  dgw_device_close(app->dev);
+  app->dev = NULL;
+  g_free(app->trace_file);
 }
 
-#define MB_ADDR_FW_LOW 480
-#define MB_ADDR_FW_HIGH 481
-#define MB_ADDR_MODNAME_LOW 482
-#define MB_ADDR_MODNAME_HIGH 483
-#define MB_ADDR_BUS_ADDR 484
-#define MB_ADDR_SER_CONF 485
-#define MB_ADDR_RESP_DELAY 487
-#define MB_ADDR_WD_TIMEOUT 488
-#define MB_ADDR_WD_COUNT 491
-#define MB_ADDR_PROTO 256
-#define MB_ADDR_WD_ENABLED 260
-#define MB_ADDR_CMD_QUEUE 32
-#define MB_ADDR_REPLY_QUEUE 0
-#define MB_ADDR_CMD_READY 256
-
-
-
-
 static gboolean
 init_modbus(AppContext *app)
 {
-  app->mb = modbus_new_rtu(app->device, app->speed, 'E', 8, 1);
-  if (!app->mb) {
-    g_printerr("Failed to create Modbus context\n");
-    return FALSE;
-  }
-  modbus_set_debug(app->mb, app->debug);
-  modbus_set_slave(app->mb,app->mb_addr);
-  modbus_set_response_timeout(app->mb, 1, 0);
-  if (modbus_connect(app->mb)) {
-    g_printerr("Failed to connect\n");
+  GError *err = NULL;
+  app->dev = dgw_device_open(app->device, app->speed, 'E', app->mb_addr,
+			     &err);
+  if (!app->dev) {
+    g_printerr("%s\n", err->message);
+    g_clear_error(&err);
     return FALSE;
   }
-  
+  dgw_device_set_debug(app->dev, app->debug);
+  dgw_device_set_response_timeout(app->dev, G_USEC_PER_SEC);
   return TRUE;
 }
 
@@ -118,65 +78,21 @@ const GOptionEntry app_options[] = {
    &app.speed, "Serial speed (bps)", "SPEED"},
   {"mb-addr", 0, 0, G_OPTION_ARG_INT,
    &app.mb_addr, "Modbus address of DGW-521", "ADDR"},
+  {"trace", 0, 0, G_OPTION_ARG_FILENAME,
+   &app.trace_file, "Dump the Modbus transaction trace to FILE", "FILE"},
   {"debug", 0, 0, G_OPTION_ARG_NONE, &app.debug,
    "Turn on Modbus debugging", NULL},
   {NULL}
 };
 
-static gboolean
-send_cmd(modbus_t *mb, uint16_t *cmds, uint16_t *replies,
-	 unsigned int len, GError **err)
-{
-
-  while(len > 0) {
-    int block_len;
-    if (len > 8) {
-      block_len = 8;
-    } else {
-      block_len = len;
-    }    
-    int w = modbus_write_registers(mb, MB_ADDR_CMD_QUEUE, block_len, cmds);
-    if (w <= 0) {
-      g_set_error(err, DGW_ERROR, DGW_ERROR_WRITE, 
-		  "Failed to write to command queue: %s",
-		  modbus_strerror(errno));
-      return FALSE;
-    }
-    modbus_flush(mb);
-    while(TRUE) {
-      uint16_t ready;
-      int s = modbus_read_registers(mb, MB_ADDR_CMD_READY, 1, &ready);
-      if (s != 1) {
-	g_set_error(err, DGW_ERROR, DGW_ERROR_WRITE, 
-		    "Failed to read command done status: %s", 
-		    modbus_strerror(errno));
-	return FALSE;
-      }
-      modbus_flush(mb);
-      if (ready == 0xff) break;
-    }
-    int r = modbus_read_registers(mb, MB_ADDR_REPLY_QUEUE, block_len, replies);
-    if (r <= 0) {
-      g_set_error(err, DGW_ERROR, DGW_ERROR_WRITE, 
-		  "Failed to read replies: %s", modbus_strerror(errno));
-      return FALSE;
-    }
-    modbus_flush(mb);
-    len -= block_len;
-    cmds += block_len;
-    replies += block_len;
-  }
-  return TRUE;
-}
-
-#define MAX_CMDS 16
 int
 main(int argc, char **argv)
 {
   GError *err = NULL;
   GOptionContext *opt_ctxt;
+  const DaliTiming *timing;
   app_init(&app);
-  opt_ctxt = g_option_context_new (" - get setup info from DGW521");
+  opt_ctxt = g_option_context_new ("CMD... - send DALI commands");
   g_option_context_add_main_entries(opt_ctxt, app_options, NULL);
   if (!g_option_context_parse(opt_ctxt, &argc, &argv, &err)) {
     g_printerr("Failed to parse options: %s\n", err->message);
@@ -184,37 +100,45 @@ main(int argc, char **argv)
     return EXIT_FAILURE;
   }
   g_option_context_free(opt_ctxt);
+  dgw_trace_init(app.trace_file);
+
+  app.batch = dali_batch_new();
+  for (int c = 1; c < argc; c++) {
+    if (!dali_batch_parse(app.batch, argv[c], &err)) {
+      g_printerr("%s\n", err->message);
+      g_clear_error(&err);
+      app_cleanup(&app);
+      return EXIT_FAILURE;
+    }
+  }
+  g_debug("%d frames in %d blocks",
+	  app.batch->frames->len, app.batch->blocks->len);
+  
   if (!init_modbus(&app)) {
     app_cleanup(&app);
     return EXIT_FAILURE;
   }
 
-
-  app.n_cmds = argc - 1;
-  app.cmds = g_new(uint16_t, app.n_cmds); 
-  app.replies = g_new(uint16_t, app.n_cmds); 
-
-  for (int c = 0; c < app.n_cmds; c++) {
-    char *end;
-    app.cmds[c] = strtoul(argv[c+1], &end, 16);
-    if (end == argv[c+1] || *end != '\0') {
-      g_printerr("Invalid command %s",argv[c+1]);
-      return EXIT_FAILURE;
-    }
-  }
-  for (int c = 0; c < app.n_cmds; c++) {
-    printf("%04x\n", app.cmds[c], app.replies[c]);
-  }
-  
-  if (!send_cmd(app.mb, app.cmds, app.replies, app.n_cmds, &err)) {
+  if (!dgw_device_send(app.dev, app.batch, &err)) {
     g_printerr("Failed to send commands: %s\n", err->message);
     app_cleanup(&app);
     return EXIT_FAILURE;
   }
+  dali_batch_decode(app.batch);
+  timing = dgw_device_timing(app.dev);
+  g_debug("%" G_GUINT64_FORMAT " blocks, predicted %" G_GINT64_FORMAT
+	  "ms, took %" G_GINT64_FORMAT "ms", timing->blocks,
+	  timing->predicted_total / 1000, timing->actual_total / 1000);
   
-  for (int c = 0; c < app.n_cmds; c++) {
-    printf("%04x => %04x\n", app.cmds[c], app.replies[c]);
+  GString *line = g_string_new("");
+  for (guint c = 0; c < app.batch->results->len; c++) {
+    const DaliResult *res = &g_array_index(app.batch->results, DaliResult, c);
+    if (res->repeat) continue;
+    g_string_truncate(line, 0);
+    dali_result_format(res, line);
+    printf("%s\n", line->str);
   }
+  g_string_free(line, TRUE);
   
   app_cleanup(&app);
   return EXIT_SUCCESS;
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include "dgw_error.h"
+#include "dgw_trace.h"
+
+typedef struct AppContext AppContext;
+struct AppContext
+{
+  gboolean errors;
+};
+
+static void
+app_init(AppContext *app)
+{
+  app->errors = FALSE;
+}
+
+static void
+app_cleanup(AppContext* app)
+{
+}
+
+static const gchar *
+function_name(guint8 function)
+{
+  switch(function) {
+  case 0x01: return "read-bits";
+  case 0x03: return "read-regs";
+  case 0x04: return "read-input";
+  case 0x06: return "write-reg";
+  case 0x0f: return "write-bits";
+  case 0x10: return "write-regs";
+  }
+  return "?";
+}
+
+static void
+print_entry(const DgwTraceHeader *hdr, const DgwTraceEntry *e)
+{
+  gint64 real = hdr->real - (hdr->monotonic - e->start);
+  time_t secs = real / G_USEC_PER_SEC;
+  struct tm tm;
+  char buffer[32];
+  unsigned int i;
+  localtime_r(&secs, &tm);
+  strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm);
+  printf("%s.%06d %8u %-10s %5d %3d ", buffer, (int)(real % G_USEC_PER_SEC),
+	 e->seq, function_name(e->function), e->addr, e->count);
+  if (!e->done) {
+    printf("no reply\n");
+    return;
+  }
+  printf("%6.1fms ", (e->end - e->start) / 1000.0);
+  if (e->result < 0) {
+    printf("error: %s\n", modbus_strerror(e->error));
+    return;
+  }
+  printf("=> %d", e->result);
+  if (e->function == 0x01 || e->function == 0x0f) {
+    for (i = 0; i < e->n_data; i++) {
+      printf(" %d", e->data[i]);
+    }
+  } else {
+    for (i = 0; i + 1 < e->n_data; i += 2) {
+      uint16_t v;
+      memcpy(&v, &e->data[i], sizeof(v));
+      printf(" %04x", v);
+    }
+  }
+  printf("\n");
+}
+
+static gboolean
+print_dump(AppContext *app, const gchar *path, GError **err)
+{
+  gchar *data;
+  gsize len;
+  const DgwTraceHeader *hdr;
+  const DgwTraceEntry *entries;
+  guint32 i;
+  if (!g_file_get_contents(path, &data, &len, err)) return FALSE;
+  hdr = (const DgwTraceHeader*)data;
+  if (len < sizeof(*hdr)
+      || memcmp(hdr->magic, DGW_TRACE_MAGIC, DGW_TRACE_MAGIC_LEN) != 0) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_READ,
+		"%s is not a transaction trace", path);
+    g_free(data);
+    return FALSE;
+  }
+  if (hdr->byte_order != 0x01020304
+      || hdr->entry_size != sizeof(DgwTraceEntry)
+      || len < sizeof(*hdr) + (gsize)hdr->n_entries * hdr->entry_size) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_READ,
+		"%s was written on another kind of machine or is truncated",
+		path);
+    g_free(data);
+    return FALSE;
+  }
+  entries = (const DgwTraceEntry*)(data + sizeof(*hdr));
+  printf("%s: pid %u, %u transactions, dumped because of %.*s\n",
+	 path, hdr->pid, hdr->n_entries, DGW_TRACE_REASON_MAX, hdr->reason);
+  for (i = 0; i < hdr->n_entries; i++) {
+    const DgwTraceEntry *e = &entries[i];
+    /* Being filled in when the dump was written */
+    if (e->seq == 0) continue;
+    if (app->errors && e->done && e->result >= 0) continue;
+    print_entry(hdr, e);
+  }
+  g_free(data);
+  return TRUE;
+}
+
+AppContext app;
+
+const GOptionEntry app_options[] = {
+  {"errors", 'e', 0, G_OPTION_ARG_NONE,
+   &app.errors, "Only show failed or unfinished transactions", NULL},
+  {NULL}
+};
+
+int
+main(int argc, char **argv)
+{
+  GError *err = NULL;
+  GOptionContext *opt_ctxt;
+  int ret = EXIT_SUCCESS;
+  int i;
+  app_init(&app);
+  opt_ctxt = g_option_context_new ("FILE... - show Modbus transaction traces");
+  g_option_context_add_main_entries(opt_ctxt, app_options, NULL);
+  if (!g_option_context_parse(opt_ctxt, &argc, &argv, &err)) {
+    g_printerr("Failed to parse options: %s\n", err->message);
+    app_cleanup(&app);
+    return EXIT_FAILURE;
+  }
+  g_option_context_free(opt_ctxt);
+  for (i = 1; i < argc; i++) {
+    if (!print_dump(&app, argv[i], &err)) {
+      g_printerr("%s\n", err->message);
+      g_clear_error(&err);
+      ret = EXIT_FAILURE;
+    }
+  }
+  app_cleanup(&app);
+  return ret;
+}
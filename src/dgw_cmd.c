@@ -0,0 +1,67 @@
+#include "dgw_cmd.h"
+#include "dgw_error.h"
+#include "dgw_trace.h"
+#include "dgw_regs.h"
+#include <errno.h>
+
+/* Send at most DALI_BLOCK_MAX frames through the command queue and wait
+   until the gateway has sent them. */
+gboolean
+dgw_cmd_send_block(modbus_t *mb, const uint16_t *cmds, uint16_t *replies,
+		   guint len, DaliTiming *timing, GError **err)
+{
+  gint64 predicted = dali_timing_predict(timing, cmds, len);
+  gint64 start;
+  gint64 now;
+  gint64 next;
+  gint64 interval = 0;
+  guint checks = 0;
+  int w = dgw_trace_write_registers(mb, MB_ADDR_CMD_QUEUE, len, cmds);
+  if (w <= 0) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_WRITE, 
+		"Failed to write to command queue: %s",
+		modbus_strerror(errno));
+    return FALSE;
+  }
+  modbus_flush(mb);
+  /* Don't check until the frames should have been sent, then back off */
+  start = g_get_monotonic_time();
+  next = start + predicted;
+  while(TRUE) {
+    uint16_t ready;
+    int s;
+    now = g_get_monotonic_time();
+    if (next > now) g_usleep(next - now);
+    s = dgw_trace_read_registers(mb, MB_ADDR_CMD_READY, 1, &ready);
+    checks++;
+    if (s != 1) {
+      g_set_error(err, DGW_ERROR, DGW_ERROR_WRITE, 
+		  "Failed to read command done status: %s", 
+		  modbus_strerror(errno));
+      return FALSE;
+    }
+    modbus_flush(mb);
+    now = g_get_monotonic_time();
+    if (ready == 0xff) break;
+    if (now - start >= dali_timing_deadline(predicted)) {
+      dali_timing_timeout(timing, predicted);
+      dgw_trace_dump("command timeout", TRUE);
+      g_set_error(err, DGW_ERROR, DGW_ERROR_TIMEOUT,
+		  "Command block not done after %" G_GINT64_FORMAT
+		  "ms (expected %" G_GINT64_FORMAT "ms)",
+		  (now - start) / 1000, predicted / 1000);
+      return FALSE;
+    }
+    interval = dali_timing_backoff(predicted, interval);
+    next = MIN(now + interval, start + dali_timing_deadline(predicted));
+  }
+  dali_timing_update(timing, predicted, now - start, checks == 1);
+  int r = dgw_trace_read_registers(mb, MB_ADDR_REPLY_QUEUE, len, replies);
+  if (r <= 0) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_WRITE, 
+		"Failed to read replies: %s", modbus_strerror(errno));
+    return FALSE;
+  }
+  modbus_flush(mb);
+  return TRUE;
+}
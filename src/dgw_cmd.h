@@ -0,0 +1,14 @@
+#ifndef __DGW_CMD_H__
+#define __DGW_CMD_H__
+
+#include <stdint.h>
+#include <glib.h>
+#include <modbus.h>
+#include "dali_cmd.h"
+#include "dali_timing.h"
+
+gboolean
+dgw_cmd_send_block(modbus_t *mb, const uint16_t *cmds, uint16_t *replies,
+		   guint len, DaliTiming *timing, GError **err);
+
+#endif /* __DGW_CMD_H__ */
@@ -0,0 +1,533 @@
+#include "dgw_device.h"
+#include "dgw_error.h"
+#include "dgw_trace.h"
+#include "dgw_cmd.h"
+#include "dgw_ring.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <modbus-rtu.h>
+
+/* The gateway needs a pause after some of the info reads */
+#define INFO_READ_PAUSE (G_USEC_PER_SEC * 3 / 10)
+
+typedef struct DgwPort DgwPort;
+struct DgwPort
+{
+  gchar *path;
+  guint speed;
+  char parity;
+  modbus_t *mb;
+  GRecMutex mutex;
+  guint refs;
+  /* Modbus address the context is currently set to */
+  gint slave;
+};
+
+struct DgwDevice
+{
+  DgwPort *port;
+  guint mb_addr;
+  DaliTiming timing;
+  guint64 transactions;
+  DgwRecordFunc record_func;
+  gpointer record_data;
+  gboolean polled;
+  uint16_t last_seq;
+};
+
+static GMutex pool_mutex;
+static GHashTable *pool = NULL; /* path -> DgwPort */
+
+static DgwPort *
+port_open(const gchar *path, guint speed, char parity, GError **err)
+{
+  DgwPort *port;
+  modbus_t *mb;
+  if (!pool) pool = g_hash_table_new(g_str_hash, g_str_equal);
+  port = g_hash_table_lookup(pool, path);
+  if (port) {
+    if (port->speed != speed || port->parity != parity) {
+      g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		  "%s is already open with different settings", path);
+      return NULL;
+    }
+    port->refs++;
+    return port;
+  }
+  mb = modbus_new_rtu(path, speed, parity, 8, 1);
+  if (!mb) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		"Failed to create Modbus context for %s: %s",
+		path, modbus_strerror(errno));
+    return NULL;
+  }
+  if (modbus_connect(mb)) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_READ,
+		"Failed to connect to %s: %s", path, modbus_strerror(errno));
+    modbus_free(mb);
+    return NULL;
+  }
+  port = g_new(DgwPort, 1);
+  port->path = g_strdup(path);
+  port->speed = speed;
+  port->parity = parity;
+  port->mb = mb;
+  g_rec_mutex_init(&port->mutex);
+  port->refs = 1;
+  port->slave = -1;
+  g_hash_table_insert(pool, port->path, port);
+  return port;
+}
+
+static void
+port_close(DgwPort *port)
+{
+  if (--port->refs > 0) return;
+  g_hash_table_remove(pool, port->path);
+  modbus_close(port->mb);
+  modbus_free(port->mb);
+  g_rec_mutex_clear(&port->mutex);
+  g_free(port->path);
+  g_free(port);
+}
+
+DgwDevice *
+dgw_device_open(const gchar *port, guint speed, char parity, guint mb_addr,
+		GError **err)
+{
+  DgwDevice *dev;
+  DgwPort *p;
+  g_mutex_lock(&pool_mutex);
+  p = port_open(port, speed, parity, err);
+  g_mutex_unlock(&pool_mutex);
+  if (!p) return NULL;
+  dev = g_new(DgwDevice, 1);
+  dev->port = p;
+  dev->mb_addr = mb_addr;
+  dali_timing_init(&dev->timing);
+  dev->transactions = 0;
+  dev->record_func = NULL;
+  dev->record_data = NULL;
+  dev->polled = FALSE;
+  dev->last_seq = 0;
+  return dev;
+}
+
+void
+dgw_device_close(DgwDevice *dev)
+{
+  if (!dev) return;
+  g_mutex_lock(&pool_mutex);
+  port_close(dev->port);
+  g_mutex_unlock(&pool_mutex);
+  g_free(dev);
+}
+
+modbus_t *
+dgw_device_lock(DgwDevice *dev)
+{
+  DgwPort *port = dev->port;
+  g_rec_mutex_lock(&port->mutex);
+  if (port->slave != (gint)dev->mb_addr) {
+    modbus_set_slave(port->mb, dev->mb_addr);
+    port->slave = dev->mb_addr;
+  }
+  return port->mb;
+}
+
+void
+dgw_device_unlock(DgwDevice *dev)
+{
+  g_rec_mutex_unlock(&dev->port->mutex);
+}
+
+/* Applies to all devices on the port */
+void
+dgw_device_set_debug(DgwDevice *dev, gboolean debug)
+{
+  modbus_set_debug(dgw_device_lock(dev), debug);
+  dgw_device_unlock(dev);
+}
+
+/* Applies to all devices on the port */
+void
+dgw_device_set_response_timeout(DgwDevice *dev, gint64 timeout)
+{
+  modbus_set_response_timeout(dgw_device_lock(dev),
+			      timeout / G_USEC_PER_SEC,
+			      timeout % G_USEC_PER_SEC);
+  dgw_device_unlock(dev);
+}
+
+guint64
+dgw_device_transactions(DgwDevice *dev)
+{
+  guint64 n;
+  dgw_device_lock(dev);
+  n = dev->transactions;
+  dgw_device_unlock(dev);
+  return n;
+}
+
+/* One transaction, the port must be locked. what describes the data
+   for the error message, NULL for a generic description. */
+static gboolean
+run_op(DgwDevice *dev, modbus_t *mb, const DgwOp *op, const char *what,
+       GError **err)
+{
+  static const char *kinds[] = {
+    "bits", "registers", "input registers", "bits", "registers", "register"
+  };
+  gboolean write = op->type >= DGW_OP_WRITE_BITS;
+  int r = -1;
+  int error;
+  switch(op->type) {
+  case DGW_OP_READ_BITS:
+    r = dgw_trace_read_bits(mb, op->addr, op->count, op->data);
+    break;
+  case DGW_OP_READ_REGISTERS:
+    r = dgw_trace_read_registers(mb, op->addr, op->count, op->data);
+    break;
+  case DGW_OP_READ_INPUT_REGISTERS:
+    r = dgw_trace_read_input_registers(mb, op->addr, op->count, op->data);
+    break;
+  case DGW_OP_WRITE_BITS:
+    r = dgw_trace_write_bits(mb, op->addr, op->count, op->data);
+    break;
+  case DGW_OP_WRITE_REGISTERS:
+    r = dgw_trace_write_registers(mb, op->addr, op->count, op->data);
+    break;
+  case DGW_OP_WRITE_REGISTER:
+    r = dgw_trace_write_register(mb, op->addr, *(const uint16_t*)op->data);
+    break;
+  }
+  error = errno;
+  dev->transactions++;
+  modbus_flush(mb);
+  if (r == op->count) return TRUE;
+  if (r >= 0) error = EMBBADDATA;
+  if (what) {
+    g_set_error(err, DGW_ERROR, write ? DGW_ERROR_WRITE : DGW_ERROR_READ,
+		"Failed to %s %s: %s", write ? "write" : "read", what,
+		modbus_strerror(error));
+  } else {
+    g_set_error(err, DGW_ERROR, write ? DGW_ERROR_WRITE : DGW_ERROR_READ,
+		"Failed to %s %d %s at %d: %s", write ? "write" : "read",
+		op->count, kinds[op->type], op->addr, modbus_strerror(error));
+  }
+  return FALSE;
+}
+
+gboolean
+dgw_device_transact(DgwDevice *dev, DgwOp *ops, guint n_ops, GError **err)
+{
+  modbus_t *mb = dgw_device_lock(dev);
+  guint i;
+  for (i = 0; i < n_ops; i++) {
+    if (!run_op(dev, mb, &ops[i], NULL, err)) break;
+  }
+  dgw_device_unlock(dev);
+  return i == n_ops;
+}
+
+gboolean
+dgw_device_read_info(DgwDevice *dev, DgwInfo *info, GError **err)
+{
+  uint16_t fw[2];
+  uint16_t mod_name[2];
+  uint8_t wd_enabled;
+  DgwOp ops[] = {
+    {DGW_OP_READ_INPUT_REGISTERS, MB_ADDR_FW_LOW, 2, fw},
+    {DGW_OP_READ_INPUT_REGISTERS, MB_ADDR_MODNAME_LOW, 2, mod_name},
+    {DGW_OP_READ_REGISTERS, MB_ADDR_BUS_ADDR, 1, &info->bus_addr},
+    {DGW_OP_READ_REGISTERS, MB_ADDR_SER_CONF, 1, &info->serial_conf},
+    {DGW_OP_READ_BITS, MB_ADDR_WD_ENABLED, 1, &wd_enabled},
+    {DGW_OP_READ_REGISTERS, MB_ADDR_WD_TIMEOUT, 1, &info->watchdog_timeout}
+  };
+  static const char *what[] = {
+    "firmware version", "module name", "module address",
+    "serial port configuration", "watchdog status", "watchdog timeout"
+  };
+  modbus_t *mb = dgw_device_lock(dev);
+  guint i;
+  for (i = 0; i < G_N_ELEMENTS(ops); i++) {
+    if (!run_op(dev, mb, &ops[i], what[i], err)) {
+      dgw_device_unlock(dev);
+      return FALSE;
+    }
+    if (i < 3) {
+      g_usleep(INFO_READ_PAUSE);
+      modbus_flush(mb);
+    }
+  }
+  dgw_device_unlock(dev);
+  info->firmware = fw[0] | ((guint32)fw[1] << 16);
+  info->module_name = mod_name[0] | ((guint32)mod_name[1] << 16);
+  info->watchdog_enabled = wd_enabled;
+  return TRUE;
+}
+
+const gchar *
+dgw_serial_conf_speed(guint16 conf)
+{
+  static const char *bps[32] = {"?", "?", "?", "1200", "2400", "4800", "9600",
+				"19200", "38400", "57600", "115200"};
+  return bps[conf & 0x1f] ? bps[conf & 0x1f] : "?";
+}
+
+const gchar *
+dgw_serial_conf_format(guint16 conf)
+{
+  static const char *ps[4] = {"N,1","N,2", "E,1", "O,1"};
+  return ps[(conf >> 6) & 0x03];
+}
+
+static gboolean
+write_register(DgwDevice *dev, int addr, uint16_t value, const char *what,
+	       GError **err)
+{
+  DgwOp op = {DGW_OP_WRITE_REGISTER, addr, 1, &value};
+  modbus_t *mb = dgw_device_lock(dev);
+  gboolean ok = run_op(dev, mb, &op, what, err);
+  dgw_device_unlock(dev);
+  return ok;
+}
+
+gboolean
+dgw_device_set_bus_addr(DgwDevice *dev, gint addr, GError **err)
+{
+  if (addr < 1 || addr > 247) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		"Invalid Modbus address");
+    return FALSE;
+  }
+  return write_register(dev, MB_ADDR_BUS_ADDR, addr,
+			"Modbus address setting", err);
+}
+
+/* conf is BAUD[,N|O|E] */
+gboolean
+dgw_device_set_serial(DgwDevice *dev, const gchar *conf, GError **err)
+{
+  char *end;
+  int baud;
+  uint16_t ser_conf = 0x00;
+  baud = strtoul(conf, &end, 10);
+  if (conf == end) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		"Unparseable baud rate");
+    return FALSE;
+  }
+  conf = end;
+  switch(baud) {
+  case 1200:
+    ser_conf = 3;
+    break;
+  case 2400:
+    ser_conf = 4;
+    break;
+  case 4800:
+    ser_conf = 5;
+    break;
+  case 9600:
+    ser_conf = 6;
+    break;
+  case 19200:
+    ser_conf = 7;
+    break;
+  case 38400:
+    ser_conf = 8;
+    break;
+  case 57600:
+    ser_conf = 9;
+    break;
+  case 115200:
+    ser_conf = 10;
+    break;
+  default:
+    g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		"Invalid baud rate");
+    return FALSE;
+  }
+  if (*conf != '\0') {
+    if (*conf != ',') {
+      g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		  "Expected comma after baud rate");
+      return FALSE;
+    }
+    conf++;
+    switch(*conf) {
+    case 'N':
+    case 'n':
+      break;
+    case 'O':
+    case 'o':
+      ser_conf |= 0xc0;
+      break;
+    case 'E':
+    case 'e':
+      ser_conf |= 0x80;
+      break;
+    default:
+      g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		  "Parity must be 'O', 'E' or 'N'");
+      return FALSE;
+    }
+  }
+  return write_register(dev, MB_ADDR_SER_CONF, ser_conf,
+			"serial settings", err);
+}
+
+gboolean
+dgw_device_set_watchdog_enabled(DgwDevice *dev, gboolean enable,
+				GError **err)
+{
+  uint8_t e = enable;
+  DgwOp op = {DGW_OP_WRITE_BITS, MB_ADDR_WD_ENABLED, 1, &e};
+  modbus_t *mb = dgw_device_lock(dev);
+  gboolean ok = run_op(dev, mb, &op, "watchdog enable", err);
+  dgw_device_unlock(dev);
+  return ok;
+}
+
+gboolean
+dgw_device_set_watchdog_timeout(DgwDevice *dev, gdouble timeout,
+				GError **err)
+{
+  int timeout_int = timeout*10;
+  if (timeout_int < 1 || timeout_int > 255) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_PARAMETER,
+		"Invalid timeout value");
+    return FALSE;
+  }
+  return write_register(dev, MB_ADDR_WD_TIMEOUT, timeout_int,
+			"watchdog timeout setting", err);
+}
+
+DaliTiming *
+dgw_device_timing(DgwDevice *dev)
+{
+  return &dev->timing;
+}
+
+gboolean
+dgw_device_send_block(DgwDevice *dev, const uint16_t *cmds,
+		      uint16_t *replies, guint len, GError **err)
+{
+  modbus_t *mb = dgw_device_lock(dev);
+  gboolean ok = dgw_cmd_send_block(mb, cmds, replies, len, &dev->timing,
+				   err);
+  dgw_device_unlock(dev);
+  return ok;
+}
+
+gboolean
+dgw_device_send(DgwDevice *dev, DaliBatch *batch, GError **err)
+{
+  uint16_t *cmds = (uint16_t*)batch->frames->data;
+  uint16_t *replies = (uint16_t*)batch->replies->data;
+  guint b;
+  for (b = 0; b < batch->blocks->len; b++) {
+    guint block_len = g_array_index(batch->blocks, guint, b);
+    if (!dgw_device_send_block(dev, cmds, replies, block_len, err)) {
+      g_prefix_error(err, "Block %d of %d: ", b + 1, batch->blocks->len);
+      return FALSE;
+    }
+    cmds += block_len;
+    replies += block_len;
+  }
+  return TRUE;
+}
+
+gboolean
+dgw_device_read_sequence(DgwDevice *dev, uint16_t *seq, GError **err)
+{
+  DgwOp op = {DGW_OP_READ_INPUT_REGISTERS, MB_ADDR_SEQUENCE, 1, seq};
+  modbus_t *mb = dgw_device_lock(dev);
+  gboolean ok = run_op(dev, mb, &op, "sequence number", err);
+  dgw_device_unlock(dev);
+  return ok;
+}
+
+gboolean
+dgw_device_read_ring(DgwDevice *dev, uint16_t *ring, GError **err)
+{
+  DgwOp op = {DGW_OP_READ_INPUT_REGISTERS, MB_ADDR_RECORDS, DGW_RING_REGS,
+	      ring};
+  modbus_t *mb = dgw_device_lock(dev);
+  gboolean ok = run_op(dev, mb, &op, "records", err);
+  dgw_device_unlock(dev);
+  return ok;
+}
+
+/* Read the records after last_seq up to and including seq, at most
+   DGW_MAX_RECORDS of them. Returns the number of records read or -1 on
+   failure. */
+int
+dgw_device_read_records(DgwDevice *dev, uint16_t last_seq, uint16_t seq,
+			uint16_t *records, GError **err)
+{
+  DgwRingPlan plan;
+  modbus_t *mb;
+  guint i;
+  dgw_ring_plan(&plan, last_seq, seq);
+  mb = dgw_device_lock(dev);
+  for (i = 0; i < plan.n_reads; i++) {
+    DgwOp op = {DGW_OP_READ_INPUT_REGISTERS,
+		MB_ADDR_RECORDS + plan.reads[i].offset, plan.reads[i].count,
+		records};
+    if (!run_op(dev, mb, &op, "records", err)) {
+      dgw_device_unlock(dev);
+      return -1;
+    }
+    records += plan.reads[i].count;
+  }
+  dgw_device_unlock(dev);
+  return plan.n_records;
+}
+
+void
+dgw_device_set_record_func(DgwDevice *dev, DgwRecordFunc func,
+			   gpointer user_data)
+{
+  dgw_device_lock(dev);
+  dev->record_func = func;
+  dev->record_data = user_data;
+  dgw_device_unlock(dev);
+}
+
+/* Read the sequence number and any new records and pass them to the
+   record function. The first poll only finds the current position.
+   Returns the number of new records or -1 on failure. */
+int
+dgw_device_poll(DgwDevice *dev, GError **err)
+{
+  uint16_t records[DGW_MAX_RECORDS * 2];
+  uint16_t seq;
+  gboolean overrun;
+  DgwRecordFunc func;
+  gpointer data;
+  int len;
+  dgw_device_lock(dev);
+  if (!dgw_device_read_sequence(dev, &seq, err)) {
+    dgw_device_unlock(dev);
+    return -1;
+  }
+  if (!dev->polled || seq == dev->last_seq) {
+    dev->polled = TRUE;
+    dev->last_seq = seq;
+    dgw_device_unlock(dev);
+    return 0;
+  }
+  overrun = (uint16_t)(seq - dev->last_seq) > DGW_MAX_RECORDS;
+  len = dgw_device_read_records(dev, dev->last_seq, seq, records, err);
+  /* After a failed read the same records are read again next time, or
+     reported as an overrun if they have been overwritten by then */
+  if (len >= 0) dev->last_seq = seq;
+  func = dev->record_func;
+  data = dev->record_data;
+  dgw_device_unlock(dev);
+  /* Outside the lock so the function may use the device */
+  if (len > 0 && func) func(dev, records, len, overrun, data);
+  return len;
+}
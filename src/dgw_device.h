@@ -0,0 +1,145 @@
+#ifndef __DGW_DEVICE_H__
+#define __DGW_DEVICE_H__
+
+#include <stdint.h>
+#include <glib.h>
+#include <modbus.h>
+#include "dgw_regs.h"
+#include "dali_cmd.h"
+#include "dali_timing.h"
+
+/* A DGW-521 gateway at a Modbus address on a serial port. All gateways
+   on the same port share one connection from a process wide pool. It is
+   opened by the first dgw_device_open for the port and closed with the
+   last device.
+
+   All functions may be called from any thread. Every call locks the
+   port for the transactions it makes, so a batch of register accesses
+   or a command block is never interleaved with those of another
+   thread. */
+typedef struct DgwDevice DgwDevice;
+
+DgwDevice *
+dgw_device_open(const gchar *port, guint speed, char parity, guint mb_addr,
+		GError **err);
+
+void
+dgw_device_close(DgwDevice *dev);
+
+void
+dgw_device_set_debug(DgwDevice *dev, gboolean debug);
+
+void
+dgw_device_set_response_timeout(DgwDevice *dev, gint64 timeout);
+
+/* Direct access to the connection for code that drives libmodbus
+   itself. The port stays locked and addressed to this device until
+   dgw_device_unlock. Locks may nest within a thread, but only for the
+   same device. */
+modbus_t *
+dgw_device_lock(DgwDevice *dev);
+
+void
+dgw_device_unlock(DgwDevice *dev);
+
+/* Number of transactions made by the dgw_device_* calls below, apart
+   from command sending */
+guint64
+dgw_device_transactions(DgwDevice *dev);
+
+typedef enum {
+  DGW_OP_READ_BITS,
+  DGW_OP_READ_REGISTERS,
+  DGW_OP_READ_INPUT_REGISTERS,
+  DGW_OP_WRITE_BITS,
+  DGW_OP_WRITE_REGISTERS,
+  DGW_OP_WRITE_REGISTER
+} DgwOpType;
+
+/* One Modbus transaction. data is uint8_t[count] for bits and
+   uint16_t[count] for registers. DGW_OP_WRITE_REGISTER writes a single
+   register with function 6, count must be 1. */
+typedef struct DgwOp DgwOp;
+struct DgwOp
+{
+  DgwOpType type;
+  int addr;
+  int count;
+  void *data;
+};
+
+/* Run all ops in order without releasing the port. Stops at the first
+   failure. */
+gboolean
+dgw_device_transact(DgwDevice *dev, DgwOp *ops, guint n_ops, GError **err);
+
+typedef struct DgwInfo DgwInfo;
+struct DgwInfo
+{
+  guint32 firmware;
+  guint32 module_name;
+  guint16 bus_addr;
+  guint16 serial_conf;
+  gboolean watchdog_enabled;
+  guint16 watchdog_timeout; /* 0.1 s */
+};
+
+gboolean
+dgw_device_read_info(DgwDevice *dev, DgwInfo *info, GError **err);
+
+const gchar *
+dgw_serial_conf_speed(guint16 conf);
+
+const gchar *
+dgw_serial_conf_format(guint16 conf);
+
+gboolean
+dgw_device_set_bus_addr(DgwDevice *dev, gint addr, GError **err);
+
+gboolean
+dgw_device_set_serial(DgwDevice *dev, const gchar *conf, GError **err);
+
+gboolean
+dgw_device_set_watchdog_enabled(DgwDevice *dev, gboolean enable,
+				GError **err);
+
+gboolean
+dgw_device_set_watchdog_timeout(DgwDevice *dev, gdouble timeout,
+				GError **err);
+
+/* Command timing of the device, only consistent while it is locked */
+DaliTiming *
+dgw_device_timing(DgwDevice *dev);
+
+gboolean
+dgw_device_send_block(DgwDevice *dev, const uint16_t *cmds,
+		      uint16_t *replies, guint len, GError **err);
+
+/* Send all blocks of a batch. The port is released between blocks. */
+gboolean
+dgw_device_send(DgwDevice *dev, DaliBatch *batch, GError **err);
+
+gboolean
+dgw_device_read_sequence(DgwDevice *dev, uint16_t *seq, GError **err);
+
+/* Read the whole ring, DGW_RING_REGS registers */
+gboolean
+dgw_device_read_ring(DgwDevice *dev, uint16_t *ring, GError **err);
+
+int
+dgw_device_read_records(DgwDevice *dev, uint16_t last_seq, uint16_t seq,
+			uint16_t *records, GError **err);
+
+/* Called by dgw_device_poll with the new records, two registers each.
+   overrun is set if records were lost before them. */
+typedef void (*DgwRecordFunc)(DgwDevice *dev, const uint16_t *records,
+			      guint n, gboolean overrun, gpointer user_data);
+
+void
+dgw_device_set_record_func(DgwDevice *dev, DgwRecordFunc func,
+			   gpointer user_data);
+
+int
+dgw_device_poll(DgwDevice *dev, GError **err);
+
+#endif /* __DGW_DEVICE_H__ */
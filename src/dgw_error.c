@@ -0,0 +1,11 @@
+#include "dgw_error.h"
+
+GQuark
+dgw_error_quark()
+{
+  static GQuark error_quark = 0;
+  if (error_quark == 0)
+    error_quark =
+      g_quark_from_static_string ("DGW-521-error-quark");
+  return error_quark;
+}
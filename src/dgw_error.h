@@ -0,0 +1,19 @@
+#ifndef __DGW_ERROR_H__
+#define __DGW_ERROR_H__
+
+#include <glib.h>
+
+GQuark
+dgw_error_quark();
+
+#define DGW_ERROR (dgw_error_quark())
+enum {
+  DGW_ERROR_OK = 0,
+  DGW_ERROR_READ,
+  DGW_ERROR_WRITE,
+  DGW_ERROR_PARAMETER,
+  DGW_ERROR_TIMEOUT,
+  DGW_ERROR_BUSY
+};
+
+#endif /* __DGW_ERROR_H__ */
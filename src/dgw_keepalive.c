@@ -0,0 +1,97 @@
+#include "dgw_keepalive.h"
+#include "dgw_error.h"
+#include "dgw_trace.h"
+#include "dgw_regs.h"
+#include <errno.h>
+
+/* Refresh when idle for this fraction of the timeout */
+#define REFRESH_MARGIN_DIV 2
+/* How often the trip counter is read even when there is other traffic */
+#define COUNT_INTERVAL (60 * G_USEC_PER_SEC)
+/* Wait this long before trying again after a failed refresh */
+#define RETRY_INTERVAL G_USEC_PER_SEC
+
+void
+dgw_keepalive_init(DgwKeepalive *ka)
+{
+  ka->timeout = 0;
+  ka->last_ok = 0;
+  ka->count_read = 0;
+  ka->retry = 0;
+  ka->trips = 0;
+  ka->trips_valid = FALSE;
+}
+
+static gboolean
+read_count(DgwKeepalive *ka, modbus_t *mb, gint64 now, GError **err)
+{
+  uint16_t count;
+  int r = dgw_trace_read_registers(mb, MB_ADDR_WD_COUNT, 1, &count);
+  if (r != 1) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_READ,
+		"Failed to read watchdog count: %s", modbus_strerror(errno));
+    ka->retry = now + RETRY_INTERVAL;
+    return FALSE;
+  }
+  modbus_flush(mb);
+  if (ka->trips_valid && count != ka->trips) {
+    g_warning("Watchdog tripped, count %d", count);
+  }
+  ka->trips = count;
+  ka->trips_valid = TRUE;
+  ka->count_read = now;
+  ka->last_ok = now;
+  return TRUE;
+}
+
+/* Read the watchdog configuration and the current trip count */
+gboolean
+dgw_keepalive_setup(DgwKeepalive *ka, modbus_t *mb, GError **err)
+{
+  uint8_t enabled;
+  uint16_t timeout;
+  int r = dgw_trace_read_bits(mb, MB_ADDR_WD_ENABLED, 1, &enabled);
+  if (r != 1) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_READ,
+		"Failed to read watchdog status: %s", modbus_strerror(errno));
+    return FALSE;
+  }
+  modbus_flush(mb);
+  r = dgw_trace_read_registers(mb, MB_ADDR_WD_TIMEOUT, 1, &timeout);
+  if (r != 1) {
+    g_set_error(err, DGW_ERROR, DGW_ERROR_READ,
+		"Failed to read watchdog timeout: %s", modbus_strerror(errno));
+    return FALSE;
+  }
+  modbus_flush(mb);
+  ka->timeout = enabled ? (gint64)timeout * G_USEC_PER_SEC / 10 : 0;
+  g_debug("Watchdog timeout %" G_GINT64_FORMAT "us", ka->timeout);
+  return read_count(ka, mb, g_get_monotonic_time(), err);
+}
+
+/* Record a successful transaction */
+void
+dgw_keepalive_note(DgwKeepalive *ka, gint64 now)
+{
+  ka->last_ok = now;
+}
+
+/* Time when dgw_keepalive_poll() next has something to do */
+gint64
+dgw_keepalive_next(const DgwKeepalive *ka)
+{
+  gint64 next = ka->count_read + COUNT_INTERVAL;
+  if (ka->timeout > 0) {
+    next = MIN(next, ka->last_ok + ka->timeout / REFRESH_MARGIN_DIV);
+  }
+  return MAX(next, ka->retry);
+}
+
+/* Send a refresh if the line has been idle too long. The refresh reads
+   the trip counter so it doubles as the metric update. */
+gboolean
+dgw_keepalive_poll(DgwKeepalive *ka, modbus_t *mb, gint64 now, GError **err)
+{
+  if (now < dgw_keepalive_next(ka)) return TRUE;
+  return read_count(ka, mb, now, err);
+}
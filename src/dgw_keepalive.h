@@ -0,0 +1,38 @@
+#ifndef __DGW_KEEPALIVE_H__
+#define __DGW_KEEPALIVE_H__
+
+#include <glib.h>
+#include <modbus.h>
+
+/* Keeps the gateway watchdog fed. Every successful transaction resets
+   the watchdog, so a refresh is only sent when nothing else has been
+   sent for a while. */
+typedef struct DgwKeepalive DgwKeepalive;
+struct DgwKeepalive
+{
+  /* Watchdog timeout in us, zero when the watchdog is disabled */
+  gint64 timeout;
+  gint64 last_ok;
+  gint64 count_read;
+  /* No new attempt before this after a failed refresh */
+  gint64 retry;
+  guint trips;
+  gboolean trips_valid;
+};
+
+void
+dgw_keepalive_init(DgwKeepalive *ka);
+
+gboolean
+dgw_keepalive_setup(DgwKeepalive *ka, modbus_t *mb, GError **err);
+
+void
+dgw_keepalive_note(DgwKeepalive *ka, gint64 now);
+
+gint64
+dgw_keepalive_next(const DgwKeepalive *ka);
+
+gboolean
+dgw_keepalive_poll(DgwKeepalive *ka, modbus_t *mb, gint64 now, GError **err);
+
+#endif /* __DGW_KEEPALIVE_H__ */
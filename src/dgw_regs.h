@@ -0,0 +1,35 @@
+#ifndef __DGW_REGS_H__
+#define __DGW_REGS_H__
+
+/* Modbus address map of the DGW-521 */
+
+/* Holding registers */
+#define MB_ADDR_REPLY_QUEUE 0
+#define MB_ADDR_CMD_QUEUE 32
+#define MB_ADDR_CMD_READY 256
+#define MB_ADDR_BUS_ADDR 484
+#define MB_ADDR_SER_CONF 485
+#define MB_ADDR_RESP_DELAY 487
+#define MB_ADDR_WD_TIMEOUT 488
+#define MB_ADDR_WD_COUNT 491
+
+/* Input registers */
+#define MB_ADDR_SEQUENCE 322
+#define MB_ADDR_FW_LOW 480
+#define MB_ADDR_FW_HIGH 481
+#define MB_ADDR_MODNAME_LOW 482
+#define MB_ADDR_MODNAME_HIGH 483
+#define MB_ADDR_RECORDS 1024
+
+/* Coils */
+#define MB_ADDR_PROTO 256
+#define MB_ADDR_WD_ENABLED 260
+
+/* The record ring holds 32 records of two registers. Record seq is in
+   slot seq & 0x1f. */
+#define DGW_RING_REGS 64
+/* Don't read the full buffer since the oldest records risk being
+   overwritten. */
+#define DGW_MAX_RECORDS 24
+
+#endif /* __DGW_REGS_H__ */
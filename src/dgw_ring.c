@@ -0,0 +1,61 @@
+#include "dgw_ring.h"
+
+void
+dgw_ring_plan(DgwRingPlan *plan, uint16_t last_seq, uint16_t seq)
+{
+  uint16_t len = seq - last_seq;
+  guint start;
+  guint end;
+  plan->overrun = len > DGW_MAX_RECORDS;
+  if (plan->overrun) len = DGW_MAX_RECORDS;
+  plan->n_records = len;
+  plan->n_reads = 0;
+  if (len == 0) return;
+  /* First slot and the slot after the last one, as register offsets.
+     Since len is less than the number of slots they are only equal when
+     there is nothing to read. */
+  start = DGW_RING_SLOT((uint16_t)(seq + 1 - len)) * 2;
+  end = DGW_RING_SLOT((uint16_t)(seq + 1)) * 2;
+  plan->reads[0].offset = start;
+  if (start < end) {
+    plan->reads[0].count = end - start;
+    plan->n_reads = 1;
+  } else {
+    /* Wraps around the end of the ring */
+    plan->reads[0].count = DGW_RING_REGS - start;
+    plan->n_reads = 1;
+    if (end > 0) {
+      plan->reads[1].offset = 0;
+      plan->reads[1].count = end;
+      plan->n_reads = 2;
+    }
+  }
+}
+
+int
+dgw_ring_diff(const uint16_t *old, const uint16_t *ring, uint16_t last_seq,
+	      uint16_t *records)
+{
+  guint32 changed = 0;
+  guint32 run = 0;
+  guint first = DGW_RING_SLOT(last_seq + 1);
+  guint n = 0;
+  guint i;
+  for (i = 0; i < DGW_RING_REGS / 2; i++) {
+    if (ring[i*2] != old[i*2] || ring[i*2+1] != old[i*2+1]) {
+      changed |= 1u << i;
+    }
+  }
+  if (changed == 0) return 0;
+  while (n < DGW_RING_REGS / 2
+	 && (changed & (1u << DGW_RING_SLOT(first + n)))) {
+    run |= 1u << DGW_RING_SLOT(first + n);
+    n++;
+  }
+  if (changed != run || n > DGW_MAX_RECORDS) return -1;
+  for (i = 0; i < n; i++) {
+    records[i*2] = ring[DGW_RING_SLOT(first + i) * 2];
+    records[i*2+1] = ring[DGW_RING_SLOT(first + i) * 2 + 1];
+  }
+  return n;
+}
@@ -0,0 +1,47 @@
+#ifndef __DGW_RING_H__
+#define __DGW_RING_H__
+
+#include <stdint.h>
+#include <glib.h>
+#include "dgw_regs.h"
+
+/* Record seq is in slot DGW_RING_SLOT(seq) of the ring, registers
+   2 * slot and 2 * slot + 1 from MB_ADDR_RECORDS */
+#define DGW_RING_SLOT(seq) ((seq) & (DGW_RING_REGS / 2 - 1))
+
+/* Part of the ring to read, in registers from MB_ADDR_RECORDS */
+typedef struct DgwRingRead DgwRingRead;
+struct DgwRingRead
+{
+  guint offset;
+  guint count;
+};
+
+/* The reads needed to get the records after last_seq up to and
+   including seq, oldest first. Only the newest DGW_MAX_RECORDS are
+   read, overrun is set if there were more. The reads are done in order
+   into consecutive parts of the record buffer. */
+typedef struct DgwRingPlan DgwRingPlan;
+struct DgwRingPlan
+{
+  guint n_records;
+  gboolean overrun;
+  guint n_reads;
+  DgwRingRead reads[2];
+};
+
+void
+dgw_ring_plan(DgwRingPlan *plan, uint16_t last_seq, uint16_t seq);
+
+/* Compare a read of the whole ring with the previous one. The records
+   after last_seq normally show up as a run of changed slots starting at
+   DGW_RING_SLOT(last_seq + 1), they are then copied to records, oldest
+   first. Returns the number of new records, 0 if nothing has changed or
+   -1 if the changes are not such a run of at most DGW_MAX_RECORDS, e.g.
+   because a new record is identical to the one it replaced. The
+   sequence number has to be read to find the new records then. */
+int
+dgw_ring_diff(const uint16_t *old, const uint16_t *ring, uint16_t last_seq,
+	      uint16_t *records);
+
+#endif /* __DGW_RING_H__ */
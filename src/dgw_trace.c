@@ -0,0 +1,261 @@
+#include "dgw_trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Entries are claimed with an atomic counter and published by setting
+   seq last, so tracing never takes a lock. The dump reads the ring as it
+   is, entries that are being written are recognized by their seq. */
+static DgwTraceEntry ring[DGW_TRACE_ENTRIES];
+static gint head = 0;
+
+/* Set up front since the dump may run in a signal handler */
+static char dump_path[PATH_MAX];
+static char tmp_path[PATH_MAX];
+static gint dumping = 0;
+/* Only accessed atomically, gint64 has no g_atomic functions */
+static gint64 last_dump = 0;
+
+static gboolean
+write_all(int fd, const void *data, gsize len)
+{
+  const char *p = data;
+  while (len > 0) {
+    ssize_t w = write(fd, p, len);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return FALSE;
+    }
+    p += w;
+    len -= w;
+  }
+  return TRUE;
+}
+
+/* Only async-signal-safe calls from here. g_get_monotonic_time() and
+   g_get_real_time() are not guaranteed to be, so the clocks are read
+   directly. */
+static gint64
+clock_usec(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static gboolean
+write_dump(const char *reason)
+{
+  DgwTraceHeader hdr;
+  guint32 n = g_atomic_int_get(&head);
+  guint32 first = n % DGW_TRACE_ENTRIES;
+  gboolean ok;
+  int fd;
+  if (dump_path[0] == '\0') return FALSE;
+  /* Never follow or reuse whatever is in the way */
+  unlink(tmp_path);
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+	    0644);
+  if (fd < 0) return FALSE;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, DGW_TRACE_MAGIC, DGW_TRACE_MAGIC_LEN);
+  hdr.byte_order = 0x01020304;
+  hdr.entry_size = sizeof(DgwTraceEntry);
+  hdr.n_entries = MIN(n, DGW_TRACE_ENTRIES);
+  hdr.pid = getpid();
+  hdr.monotonic = clock_usec(CLOCK_MONOTONIC);
+  hdr.real = clock_usec(CLOCK_REALTIME);
+  strncpy(hdr.reason, reason, DGW_TRACE_REASON_MAX - 1);
+  ok = write_all(fd, &hdr, sizeof(hdr));
+  if (n <= DGW_TRACE_ENTRIES) {
+    ok = ok && write_all(fd, ring, n * sizeof(DgwTraceEntry));
+  } else {
+    ok = ok && write_all(fd, &ring[first],
+			 (DGW_TRACE_ENTRIES - first) * sizeof(DgwTraceEntry));
+    ok = ok && write_all(fd, ring, first * sizeof(DgwTraceEntry));
+  }
+  if (close(fd) < 0) ok = FALSE;
+  if (!ok || rename(tmp_path, dump_path) < 0) {
+    unlink(tmp_path);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+signal_dump(int sig)
+{
+  int saved_errno = errno;
+  if (g_atomic_int_compare_and_exchange(&dumping, 0, 1)) {
+    write_dump(sig == SIGUSR2 ? "signal" : "crash");
+    g_atomic_int_set(&dumping, 0);
+  }
+  errno = saved_errno;
+  /* The handler has been reset, so this crashes for real */
+  if (sig != SIGUSR2) raise(sig);
+}
+
+/* Dump to path, or a file in the user's runtime directory if NULL. The
+   temporary directory is writable by everyone, so it is not used for a
+   file with a predictable name. */
+void
+dgw_trace_init(const gchar *path)
+{
+  static const int crash_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL,
+				      SIGABRT};
+  struct sigaction sa;
+  gchar *def = NULL;
+  unsigned int i;
+  if (!path) {
+    gchar *name = g_strdup_printf("%s-%d" DGW_TRACE_SUFFIX,
+				  g_get_prgname() ? g_get_prgname() : "dgw521",
+				  (int)getpid());
+    g_mkdir_with_parents(g_get_user_runtime_dir(), 0700);
+    def = g_build_filename(g_get_user_runtime_dir(), name, NULL);
+    g_free(name);
+    path = def;
+  }
+  g_strlcpy(dump_path, path, sizeof(dump_path));
+  g_snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  g_free(def);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = signal_dump;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR2, &sa, NULL);
+  sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+  for (i = 0; i < G_N_ELEMENTS(crash_signals); i++) {
+    sigaction(crash_signals[i], &sa, NULL);
+  }
+}
+
+guint32
+dgw_trace_begin(guint8 function, int addr, int count)
+{
+  guint32 id = (guint32)g_atomic_int_add(&head, 1);
+  DgwTraceEntry *e = &ring[id % DGW_TRACE_ENTRIES];
+  g_atomic_int_set((gint*)&e->seq, 0);
+  e->done = 0;
+  e->function = function;
+  e->n_data = 0;
+  e->addr = addr;
+  e->count = count;
+  e->result = 0;
+  e->error = 0;
+  e->start = g_get_monotonic_time();
+  e->end = 0;
+  g_atomic_int_set((gint*)&e->seq, id + 1);
+  return id;
+}
+
+void
+dgw_trace_end(guint32 id, int result, const void *data, gsize len)
+{
+  DgwTraceEntry *e = &ring[id % DGW_TRACE_ENTRIES];
+  int error = errno;
+  /* Give up if the ring has wrapped during the transaction */
+  if ((guint32)g_atomic_int_get((gint*)&e->seq) != id + 1) return;
+  e->end = g_get_monotonic_time();
+  e->result = result;
+  e->error = result < 0 ? error : 0;
+  if (data) {
+    e->n_data = MIN(len, DGW_TRACE_DATA_MAX);
+    memcpy(e->data, data, e->n_data);
+  }
+  g_atomic_int_set((gint*)&e->done, 1);
+  if (result < 0 && error == ETIMEDOUT) {
+    dgw_trace_dump("timeout", TRUE);
+  }
+  errno = error;
+}
+
+/* Write the ring to the dump file. With limit set, nothing is written if
+   the last dump is more recent than DGW_TRACE_DUMP_INTERVAL. */
+gboolean
+dgw_trace_dump(const char *reason, gboolean limit)
+{
+  gint64 now = g_get_monotonic_time();
+  gint64 last = __atomic_load_n(&last_dump, __ATOMIC_RELAXED);
+  gboolean ok;
+  if (limit) {
+    /* Claim the time slot, of concurrent dumps only one gets it */
+    if (last != 0 && now - last < DGW_TRACE_DUMP_INTERVAL) return FALSE;
+    if (!__atomic_compare_exchange_n(&last_dump, &last, now, FALSE,
+				     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return FALSE;
+    }
+  } else {
+    __atomic_store_n(&last_dump, now, __ATOMIC_RELAXED);
+  }
+  if (!g_atomic_int_compare_and_exchange(&dumping, 0, 1)) return FALSE;
+  ok = write_dump(reason);
+  g_atomic_int_set(&dumping, 0);
+  if (ok) {
+    g_printerr("Transaction trace (%s) written to %s\n", reason, dump_path);
+  } else {
+    g_printerr("Failed to write transaction trace to %s\n", dump_path);
+  }
+  return ok;
+}
+
+int
+dgw_trace_read_bits(modbus_t *mb, int addr, int nb, uint8_t *dest)
+{
+  guint32 id = dgw_trace_begin(0x01, addr, nb);
+  int r = modbus_read_bits(mb, addr, nb, dest);
+  dgw_trace_end(id, r, dest, r > 0 ? r : 0);
+  return r;
+}
+
+int
+dgw_trace_read_registers(modbus_t *mb, int addr, int nb, uint16_t *dest)
+{
+  guint32 id = dgw_trace_begin(0x03, addr, nb);
+  int r = modbus_read_registers(mb, addr, nb, dest);
+  dgw_trace_end(id, r, dest, r > 0 ? r * sizeof(uint16_t) : 0);
+  return r;
+}
+
+int
+dgw_trace_read_input_registers(modbus_t *mb, int addr, int nb,
+			       uint16_t *dest)
+{
+  guint32 id = dgw_trace_begin(0x04, addr, nb);
+  int r = modbus_read_input_registers(mb, addr, nb, dest);
+  dgw_trace_end(id, r, dest, r > 0 ? r * sizeof(uint16_t) : 0);
+  return r;
+}
+
+int
+dgw_trace_write_bits(modbus_t *mb, int addr, int nb, const uint8_t *src)
+{
+  guint32 id = dgw_trace_begin(0x0f, addr, nb);
+  int r = modbus_write_bits(mb, addr, nb, src);
+  dgw_trace_end(id, r, src, nb);
+  return r;
+}
+
+int
+dgw_trace_write_register(modbus_t *mb, int addr, uint16_t value)
+{
+  guint32 id = dgw_trace_begin(0x06, addr, 1);
+  int r = modbus_write_register(mb, addr, value);
+  dgw_trace_end(id, r, &value, sizeof(value));
+  return r;
+}
+
+int
+dgw_trace_write_registers(modbus_t *mb, int addr, int nb,
+			  const uint16_t *src)
+{
+  guint32 id = dgw_trace_begin(0x10, addr, nb);
+  int r = modbus_write_registers(mb, addr, nb, src);
+  dgw_trace_end(id, r, src, nb * sizeof(uint16_t));
+  return r;
+}
@@ -0,0 +1,88 @@
+#ifndef __DGW_TRACE_H__
+#define __DGW_TRACE_H__
+
+#include <stdint.h>
+#include <glib.h>
+#include <modbus.h>
+
+/* Every Modbus transaction made through the dgw_trace_* wrappers is
+   recorded in a fixed size ring in memory. The ring is written to a file
+   on overruns, timeouts, SIGUSR2 or when the program crashes.
+
+   A dump file is a DgwTraceHeader followed by n_entries DgwTraceEntry,
+   oldest first, in the byte order of the machine that wrote it. */
+
+#define DGW_TRACE_MAGIC "DGWTRC1\n"
+#define DGW_TRACE_MAGIC_LEN 8
+#define DGW_TRACE_SUFFIX ".dgwtrace"
+#define DGW_TRACE_ENTRIES 1024
+#define DGW_TRACE_DATA_MAX 32
+#define DGW_TRACE_REASON_MAX 16
+/* Minimum time between dumps caused by overruns and timeouts (us) */
+#define DGW_TRACE_DUMP_INTERVAL (10 * G_USEC_PER_SEC)
+
+typedef struct DgwTraceHeader DgwTraceHeader;
+struct DgwTraceHeader
+{
+  char magic[DGW_TRACE_MAGIC_LEN];
+  guint32 byte_order; /* 0x01020304 */
+  guint32 entry_size;
+  guint32 n_entries;
+  guint32 pid;
+  /* Clocks when the dump was written, to convert entry times */
+  gint64 monotonic;
+  gint64 real;
+  char reason[DGW_TRACE_REASON_MAX];
+};
+
+typedef struct DgwTraceEntry DgwTraceEntry;
+struct DgwTraceEntry
+{
+  guint32 seq;  /* Transaction number + 1, 0 while it's being filled in */
+  guint32 done; /* Zero if the transaction never returned */
+  guint8 function;
+  guint8 n_data;
+  guint16 addr;
+  guint16 count;
+  gint16 result; /* Return value from libmodbus */
+  gint32 error;  /* errno if result < 0 */
+  guint32 reserved;
+  gint64 start;  /* g_get_monotonic_time() */
+  gint64 end;
+  /* Registers or bits written or read, truncated */
+  guint8 data[DGW_TRACE_DATA_MAX];
+};
+
+void
+dgw_trace_init(const gchar *path);
+
+guint32
+dgw_trace_begin(guint8 function, int addr, int count);
+
+void
+dgw_trace_end(guint32 id, int result, const void *data, gsize len);
+
+gboolean
+dgw_trace_dump(const char *reason, gboolean limit);
+
+int
+dgw_trace_read_bits(modbus_t *mb, int addr, int nb, uint8_t *dest);
+
+int
+dgw_trace_read_registers(modbus_t *mb, int addr, int nb, uint16_t *dest);
+
+int
+dgw_trace_read_input_registers(modbus_t *mb, int addr, int nb,
+			       uint16_t *dest);
+
+int
+dgw_trace_write_bits(modbus_t *mb, int addr, int nb, const uint8_t *src);
+
+int
+dgw_trace_write_register(modbus_t *mb, int addr, uint16_t value);
+
+int
+dgw_trace_write_registers(modbus_t *mb, int addr, int nb,
+			  const uint16_t *src);
+
+#endif /* __DGW_TRACE_H__ */
@@ -0,0 +1,193 @@
+#include "sim_gateway.h"
+#include "dgw_regs.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <modbus.h>
+
+#define SIM_HOLDING_REGS 512
+#define SIM_COILS 512
+#define SIM_INPUT_REGS (MB_ADDR_RECORDS + DGW_RING_REGS)
+
+struct _modbus
+{
+  int slave;
+};
+
+static uint16_t holding[SIM_HOLDING_REGS];
+static uint8_t coils[SIM_COILS];
+static uint16_t input[SIM_INPUT_REGS];
+static guint64 transactions = 0;
+static guint fail_ring_reads = 0;
+
+void
+sim_gateway_reset(uint16_t seq)
+{
+  memset(holding, 0, sizeof(holding));
+  memset(coils, 0, sizeof(coils));
+  memset(input, 0, sizeof(input));
+  input[MB_ADDR_SEQUENCE] = seq;
+  transactions = 0;
+  fail_ring_reads = 0;
+}
+
+void
+sim_gateway_add_record(uint16_t frame, uint16_t flags)
+{
+  uint16_t seq = ++input[MB_ADDR_SEQUENCE];
+  input[MB_ADDR_RECORDS + (seq & (DGW_RING_REGS / 2 - 1)) * 2] = frame;
+  input[MB_ADDR_RECORDS + (seq & (DGW_RING_REGS / 2 - 1)) * 2 + 1] = flags;
+}
+
+void
+sim_gateway_fail_ring_reads(guint n)
+{
+  fail_ring_reads = n;
+}
+
+guint64
+sim_gateway_transactions(void)
+{
+  return transactions;
+}
+
+/* Check a request against a table of size entries */
+static gboolean
+in_range(int addr, int nb, int size)
+{
+  transactions++;
+  if (addr < 0 || nb <= 0 || addr + nb > size) {
+    errno = EMBXILADD;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+modbus_t *
+modbus_new_rtu(const char *device, int baud, char parity, int data_bit,
+	       int stop_bit)
+{
+  (void)device;
+  (void)baud;
+  (void)parity;
+  (void)data_bit;
+  (void)stop_bit;
+  return calloc(1, sizeof(modbus_t));
+}
+
+int
+modbus_connect(modbus_t *ctx)
+{
+  (void)ctx;
+  return 0;
+}
+
+void
+modbus_close(modbus_t *ctx)
+{
+  (void)ctx;
+}
+
+void
+modbus_free(modbus_t *ctx)
+{
+  free(ctx);
+}
+
+int
+modbus_flush(modbus_t *ctx)
+{
+  (void)ctx;
+  return 0;
+}
+
+int
+modbus_set_debug(modbus_t *ctx, int flag)
+{
+  (void)ctx;
+  (void)flag;
+  return 0;
+}
+
+int
+modbus_set_slave(modbus_t *ctx, int slave)
+{
+  ctx->slave = slave;
+  return 0;
+}
+
+int
+modbus_set_response_timeout(modbus_t *ctx, uint32_t to_sec, uint32_t to_usec)
+{
+  (void)ctx;
+  (void)to_sec;
+  (void)to_usec;
+  return 0;
+}
+
+const char *
+modbus_strerror(int errnum)
+{
+  if (errnum == EMBXILADD) return "Illegal data address";
+  if (errnum == EMBBADCRC) return "Invalid CRC";
+  return strerror(errnum);
+}
+
+int
+modbus_read_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest)
+{
+  (void)ctx;
+  if (!in_range(addr, nb, SIM_COILS)) return -1;
+  memcpy(dest, coils + addr, nb);
+  return nb;
+}
+
+int
+modbus_read_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest)
+{
+  (void)ctx;
+  if (!in_range(addr, nb, SIM_HOLDING_REGS)) return -1;
+  memcpy(dest, holding + addr, nb * sizeof(uint16_t));
+  return nb;
+}
+
+int
+modbus_read_input_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest)
+{
+  (void)ctx;
+  if (!in_range(addr, nb, SIM_INPUT_REGS)) return -1;
+  if (addr >= MB_ADDR_RECORDS && fail_ring_reads > 0) {
+    fail_ring_reads--;
+    errno = EMBBADCRC;
+    return -1;
+  }
+  memcpy(dest, input + addr, nb * sizeof(uint16_t));
+  return nb;
+}
+
+int
+modbus_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src)
+{
+  (void)ctx;
+  if (!in_range(addr, nb, SIM_COILS)) return -1;
+  memcpy(coils + addr, src, nb);
+  return nb;
+}
+
+int
+modbus_write_registers(modbus_t *ctx, int addr, int nb, const uint16_t *src)
+{
+  (void)ctx;
+  if (!in_range(addr, nb, SIM_HOLDING_REGS)) return -1;
+  memcpy(holding + addr, src, nb * sizeof(uint16_t));
+  return nb;
+}
+
+int
+modbus_write_register(modbus_t *ctx, int addr, const uint16_t value)
+{
+  (void)ctx;
+  if (!in_range(addr, 1, SIM_HOLDING_REGS)) return -1;
+  holding[addr] = value;
+  return 1;
+}
@@ -0,0 +1,28 @@
+#ifndef __SIM_GATEWAY_H__
+#define __SIM_GATEWAY_H__
+
+#include <stdint.h>
+#include <glib.h>
+
+/* A stand-in DGW-521 for tests. sim_gateway.c implements the libmodbus
+   calls used by libdgw521, so a program linked with it instead of
+   libmodbus talks to one simulated gateway on every port and Modbus
+   address. It has the record ring, the sequence number and plain
+   holding registers and coils. Commands written to the queue are not
+   executed. Not thread safe, callers lock the device as usual. */
+
+void
+sim_gateway_reset(uint16_t seq);
+
+/* Append a record to the ring and advance the sequence number */
+void
+sim_gateway_add_record(uint16_t frame, uint16_t flags);
+
+/* Make the next n reads of the record ring fail with a CRC error */
+void
+sim_gateway_fail_ring_reads(guint n);
+
+guint64
+sim_gateway_transactions(void);
+
+#endif /* __SIM_GATEWAY_H__ */
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glib.h>
+#include "capture.h"
+
+/* A writer that is killed after it has rotated to a new file but before
+   the first block of that file was committed must, on restart, number
+   its records on from the previous file. A writer that is killed with
+   records committed to an open block must keep them, and committing
+   after every record must not make the blocks any smaller. */
+
+#define T0 (1700000000 * (gint64)G_USEC_PER_SEC)
+#define HOUR (3600 * (gint64)G_USEC_PER_SEC)
+#define N_FIRST 2500
+#define N_KILLED 100
+#define N_RESUMED 500
+#define N_OPEN 3000
+
+/* Records 10 ms apart, committed after each one if commit is set */
+static gboolean
+add_records(CaptureWriter *writer, gint64 start, guint n, gboolean commit)
+{
+  GError *err = NULL;
+  guint i;
+  for (i = 0; i < n; i++) {
+    uint16_t rec[2] = {i, 0x08 | (10 << 6)};
+    gint64 time = start + i * 10000;
+    if (!capture_writer_add(writer, time, rec, &err)
+	|| (commit && !capture_writer_commit(writer, time, &err))) {
+      g_printerr("%s\n", err->message);
+      g_clear_error(&err);
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static CaptureWriter *
+new_writer(const gchar *prefix)
+{
+  GError *err = NULL;
+  CaptureWriter *writer = capture_writer_new(prefix, 0, HOUR, &err);
+  if (!writer) {
+    g_printerr("%s\n", err->message);
+    g_clear_error(&err);
+  }
+  return writer;
+}
+
+static gint
+compare_names(gconstpointer a, gconstpointer b)
+{
+  return strcmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+/* The capture files in dir, oldest first */
+static GPtrArray *
+list_files(const gchar *dir_name)
+{
+  GPtrArray *files = g_ptr_array_new_with_free_func(g_free);
+  GDir *dir = g_dir_open(dir_name, 0, NULL);
+  const gchar *name;
+  while (dir && (name = g_dir_read_name(dir))) {
+    if (g_str_has_suffix(name, CAPTURE_FILE_SUFFIX)) {
+      g_ptr_array_add(files, g_build_filename(dir_name, name, NULL));
+    }
+  }
+  if (dir) g_dir_close(dir);
+  g_ptr_array_sort(files, compare_names);
+  return files;
+}
+
+/* Check that the blocks of all files number the records without gaps or
+   repeats, and that there are no more blocks than expected */
+static gboolean
+check_files(const gchar *dir_name, guint64 expected, guint expected_blocks)
+{
+  GPtrArray *files = list_files(dir_name);
+  guint64 next_seq = 0;
+  guint64 size = 0;
+  guint n_blocks = 0;
+  gboolean ok = TRUE;
+  guint i;
+  guint b;
+  if (files->len != 2) {
+    g_printerr("Expected 2 capture files, found %d\n", files->len);
+    ok = FALSE;
+  }
+  for (i = 0; ok && i < files->len; i++) {
+    GError *err = NULL;
+    CaptureFile *file = capture_file_open(g_ptr_array_index(files, i), &err);
+    if (!file) {
+      g_printerr("%s\n", err->message);
+      g_clear_error(&err);
+      ok = FALSE;
+      break;
+    }
+    for (b = 0; b < file->blocks->len; b++) {
+      const CaptureBlockInfo *info =
+	&g_array_index(file->blocks, CaptureBlockInfo, b);
+      CaptureRecord records[CAPTURE_BLOCK_RECORDS];
+      if (info->first_seq != next_seq) {
+	g_printerr("Block %d of %s starts at record %" G_GUINT64_FORMAT
+		   ", expected %" G_GUINT64_FORMAT "\n",
+		   b, (gchar*)g_ptr_array_index(files, i),
+		   info->first_seq, next_seq);
+	ok = FALSE;
+      }
+      if (!capture_file_decode(file, b, records, &err)) {
+	g_printerr("%s\n", err->message);
+	g_clear_error(&err);
+	ok = FALSE;
+      }
+      next_seq = info->first_seq + info->n_records;
+    }
+    n_blocks += file->blocks->len;
+    size += file->len;
+    capture_file_close(file);
+  }
+  if (ok && next_seq != expected) {
+    g_printerr("Found %" G_GUINT64_FORMAT " records, expected %"
+	       G_GUINT64_FORMAT "\n", next_seq, expected);
+    ok = FALSE;
+  }
+  printf("%" G_GUINT64_FORMAT " records in %u blocks, %.2f bytes per"
+	 " record\n", next_seq, n_blocks, (double)size / MAX(next_seq, 1));
+  if (ok && n_blocks > expected_blocks) {
+    g_printerr("%u blocks, expected %u\n", n_blocks, expected_blocks);
+    ok = FALSE;
+  }
+  g_ptr_array_free(files, TRUE);
+  return ok;
+}
+
+/* Write records with a commit after each and die without flushing */
+static gboolean
+kill_open_writer(const gchar *prefix, gint64 start, guint n)
+{
+  pid_t pid = fork();
+  int status;
+  if (pid == 0) {
+    CaptureWriter *writer = new_writer(prefix);
+    if (!writer) _exit(1);
+    capture_writer_set_intervals(writer, 0, CAPTURE_SYNC_INTERVAL);
+    if (!add_records(writer, start, n, TRUE)) _exit(1);
+    raise(SIGKILL);
+    _exit(1);
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) != pid
+      || !WIFSIGNALED(status) || WTERMSIG(status) != SIGKILL) {
+    g_printerr("Writer was not killed as planned\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+int
+main(int argc, char *argv[])
+{
+  static const char junk[20] = "torn block header";
+  gchar *dir_name;
+  gchar *prefix;
+  GPtrArray *files;
+  CaptureWriter *writer;
+  gboolean ok;
+  pid_t pid;
+  int status;
+  int fd;
+  guint i;
+  (void)argc;
+  (void)argv;
+  dir_name = g_dir_make_tmp("test_capture-XXXXXX", NULL);
+  if (!dir_name) return 1;
+  prefix = g_build_filename(dir_name, "cap", NULL);
+
+  writer = new_writer(prefix);
+  if (!writer || !add_records(writer, T0, N_FIRST, FALSE)) return 1;
+  capture_writer_free(writer);
+
+  pid = fork();
+  if (pid == 0) {
+    /* Resumes the first file, then rotates. The new file gets its magic
+       but no block before the writer dies. */
+    writer = new_writer(prefix);
+    if (!writer || !add_records(writer, T0 + 2 * HOUR, N_KILLED, FALSE)) {
+      _exit(1);
+    }
+    raise(SIGKILL);
+    _exit(1);
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) != pid
+      || !WIFSIGNALED(status) || WTERMSIG(status) != SIGKILL) {
+    g_printerr("Writer was not killed as planned\n");
+    return 1;
+  }
+
+  /* A header that was only partly written when the host went down */
+  files = list_files(dir_name);
+  if (files->len != 2) {
+    g_printerr("Expected 2 capture files, found %d\n", files->len);
+    return 1;
+  }
+  fd = open(g_ptr_array_index(files, 1), O_WRONLY | O_APPEND);
+  if (fd < 0 || write(fd, junk, sizeof(junk)) != sizeof(junk)) return 1;
+  close(fd);
+  g_ptr_array_free(files, TRUE);
+
+  writer = new_writer(prefix);
+  if (!writer || !add_records(writer, T0 + 3 * HOUR, N_RESUMED, FALSE)) {
+    return 1;
+  }
+  capture_writer_free(writer);
+
+  /* Two full blocks and the rest in the open block at the kill, which
+     the next writer seals */
+  if (!kill_open_writer(prefix, T0 + 3 * HOUR + 60 * G_USEC_PER_SEC,
+			N_OPEN)) {
+    return 1;
+  }
+  writer = new_writer(prefix);
+  if (!writer) return 1;
+  capture_writer_free(writer);
+
+  /* Blocks of 1024 records, the last one of each write partly full */
+  ok = check_files(dir_name, N_FIRST + N_RESUMED + N_OPEN,
+		   (N_FIRST + CAPTURE_BLOCK_RECORDS - 1) / CAPTURE_BLOCK_RECORDS
+		   + (N_RESUMED + CAPTURE_BLOCK_RECORDS - 1)
+		   / CAPTURE_BLOCK_RECORDS
+		   + (N_OPEN + CAPTURE_BLOCK_RECORDS - 1)
+		   / CAPTURE_BLOCK_RECORDS);
+  files = list_files(dir_name);
+  for (i = 0; i < files->len; i++) {
+    gchar *path = g_ptr_array_index(files, i);
+    gchar *index_path = g_strdup_printf("%s" CAPTURE_INDEX_SUFFIX, path);
+    unlink(index_path);
+    unlink(path);
+    g_free(index_path);
+  }
+  g_ptr_array_free(files, TRUE);
+  rmdir(dir_name);
+  g_free(prefix);
+  g_free(dir_name);
+  return ok ? 0 : 1;
+}
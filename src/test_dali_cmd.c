@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <glib.h>
+#include "dali_cmd.h"
+
+/* Pins the range of send-twice commands, 0x20 (RESET) to 0x81 (ENABLE
+   WRITE MEMORY), and checks that the two frames of such a command always
+   end up in the same command queue block. */
+
+static guint failures = 0;
+
+#define CHECK(cond, ...)			\
+  do {						\
+    if (!(cond)) {				\
+      g_printerr(__VA_ARGS__);			\
+      g_printerr("\n");				\
+      failures++;				\
+    }						\
+  } while(0)
+
+static void
+check_send_twice(void)
+{
+  static const guint8 addr_bytes[] = {0x01, 0x7f, 0x81, 0x9f, 0xff};
+  guint a;
+  guint c;
+  for (a = 0; a < G_N_ELEMENTS(addr_bytes); a++) {
+    for (c = 0; c <= 0xff; c++) {
+      uint16_t frame = (addr_bytes[a] << 8) | c;
+      gboolean expected = c >= 0x20 && c <= 0x81;
+      CHECK(dali_frame_is_send_twice(frame) == expected,
+	    "%04x should%s be sent twice", frame, expected ? "" : " not");
+      /* Direct arc power is never a command */
+      frame &= 0xfeff;
+      CHECK(!dali_frame_is_send_twice(frame), "%04x is arc power", frame);
+    }
+  }
+  /* Special commands: INITIALISE and RANDOMISE only */
+  CHECK(dali_frame_is_send_twice(0xa500), "INITIALISE is sent twice");
+  CHECK(dali_frame_is_send_twice(0xa700), "RANDOMISE is sent twice");
+  CHECK(!dali_frame_is_send_twice(0xa100), "TERMINATE is sent once");
+}
+
+/* Parse the specs in order into a new batch and compare the block
+   sizes */
+static void
+check_blocks(const gchar **specs, const guint *blocks, guint n_blocks)
+{
+  DaliBatch *batch = dali_batch_new();
+  GError *err = NULL;
+  guint i;
+  for (i = 0; specs[i]; i++) {
+    if (!dali_batch_parse(batch, specs[i], &err)) {
+      CHECK(FALSE, "%s: %s", specs[i], err->message);
+      g_clear_error(&err);
+    }
+  }
+  CHECK(batch->blocks->len == n_blocks, "%s...: %u blocks, expected %u",
+	specs[0], batch->blocks->len, n_blocks);
+  for (i = 0; i < MIN(n_blocks, batch->blocks->len); i++) {
+    guint n = g_array_index(batch->blocks, guint, i);
+    CHECK(n == blocks[i], "%s...: block %u has %u frames, expected %u",
+	  specs[0], i, n, blocks[i]);
+  }
+  dali_batch_free(batch);
+}
+
+int
+main(int argc, char *argv[])
+{
+  /* Seven single frames, then a pair that doesn't fit in the first
+     block */
+  static const gchar *raw_pair[] = {
+    "0190", "0390", "0590", "0790", "0990", "0b90", "0d90",
+    "ff81", "ff81", NULL
+  };
+  static const guint raw_pair_blocks[] = {7, 2};
+  /* 0x82 is a plain command, so the first frame fills the block */
+  static const gchar *raw_single[] = {
+    "0190", "0390", "0590", "0790", "0990", "0b90", "0d90",
+    "ff82", "ff82", NULL
+  };
+  static const guint raw_single_blocks[] = {8, 1};
+  /* RESET pairs may not be split either */
+  static const gchar *reset[] = {"status:0-6", "reset:bc", NULL};
+  static const guint reset_blocks[] = {7, 2};
+  (void)argc;
+  (void)argv;
+  check_send_twice();
+  check_blocks(raw_pair, raw_pair_blocks, G_N_ELEMENTS(raw_pair_blocks));
+  check_blocks(raw_single, raw_single_blocks,
+	       G_N_ELEMENTS(raw_single_blocks));
+  check_blocks(reset, reset_blocks, G_N_ELEMENTS(reset_blocks));
+  printf("%u failures\n", failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "dgw_device.h"
+#include "dgw_ring.h"
+#include "sim_gateway.h"
+
+/* Polls the simulated gateway with dgw_device_poll() while it produces
+   up to a full read of records between polls, starting close to the
+   wrap of the sequence number. Every record carries its own number, so
+   lost and repeated records are counted exactly. Overruns are forced
+   now and then; only those may lose records, and exactly the ones that
+   were overwritten. Some ring reads fail, the records are then expected
+   in the next poll. The same records are then polled in snapshot mode,
+   comparing reads of the whole ring with dgw_ring_diff() like the
+   sniffer does. */
+
+#define POLLS 200000
+#define OVERRUN_EVERY 1000
+#define FAIL_EVERY 777
+#define START_SEQ 65000
+
+typedef struct PollCheck PollCheck;
+struct PollCheck
+{
+  guint32 produced;  /* Records generated so far */
+  guint32 next;      /* Number of the next record expected */
+  guint64 delivered;
+  guint64 overrun_lost;
+  guint64 lost;
+  guint64 repeated;
+  guint64 overruns;
+  guint64 false_overruns;
+};
+
+static void
+got_records(DgwDevice *dev, const uint16_t *records, guint n,
+	    gboolean overrun, gpointer user_data)
+{
+  PollCheck *check = user_data;
+  guint i;
+  (void)dev;
+  if (overrun) {
+    /* Only the newest records are left */
+    guint32 first = check->produced - n;
+    check->overruns++;
+    if (first <= check->next) check->false_overruns++;
+    else check->overrun_lost += first - check->next;
+    check->next = first;
+  }
+  for (i = 0; i < n; i++) {
+    guint32 number = records[i*2] | ((guint32)records[i*2+1] << 16);
+    if (number < check->next) {
+      check->repeated++;
+    } else if (number > check->next) {
+      check->lost += number - check->next;
+    }
+    check->next = number + 1;
+    check->delivered++;
+  }
+}
+
+static void
+produce(PollCheck *check, guint n)
+{
+  while (n-- > 0) {
+    guint32 number = check->produced++;
+    sim_gateway_add_record(number & 0xffff, number >> 16);
+  }
+}
+
+static void
+print_check(const char *mode, const PollCheck *check, guint failures)
+{
+  printf("%s: %u records produced, %u polls failed, %" G_GUINT64_FORMAT
+	 " delivered, %" G_GUINT64_FORMAT " lost in %"
+	 G_GUINT64_FORMAT " overruns, %"
+	 G_GUINT64_FORMAT " lost otherwise, %" G_GUINT64_FORMAT
+	 " repeated, %.3f transactions per record\n", mode,
+	 check->produced, failures, check->delivered, check->overrun_lost,
+	 check->overruns, check->lost, check->repeated,
+	 (double)sim_gateway_transactions() / check->delivered);
+}
+
+/* One snapshot mode poll, the sequence number is only read when the
+   changes of the ring are ambiguous */
+static int
+poll_snapshot(DgwDevice *dev, uint16_t *ring, uint16_t *last_seq,
+	      uint16_t *records, gboolean *overrun, GError **err)
+{
+  uint16_t new_ring[DGW_RING_REGS];
+  uint16_t seq;
+  int len;
+  *overrun = FALSE;
+  if (!dgw_device_read_ring(dev, new_ring, err)) return -1;
+  len = dgw_ring_diff(ring, new_ring, *last_seq, records);
+  memcpy(ring, new_ring, sizeof(new_ring));
+  if (len >= 0) {
+    *last_seq += len;
+    return len;
+  }
+  if (!dgw_device_read_sequence(dev, &seq, err)) return -1;
+  *overrun = (uint16_t)(seq - *last_seq) > DGW_MAX_RECORDS;
+  len = dgw_device_read_records(dev, *last_seq, seq, records, err);
+  if (len >= 0) *last_seq = seq;
+  return len;
+}
+
+static gboolean
+check_snapshot(void)
+{
+  PollCheck check = {0};
+  GError *err = NULL;
+  DgwDevice *dev;
+  uint16_t ring[DGW_RING_REGS];
+  uint16_t records[DGW_MAX_RECORDS * 2];
+  uint16_t last_seq;
+  guint pending = 0;
+  guint overruns = 0;
+  guint p;
+  srand(1);
+  sim_gateway_reset(START_SEQ);
+  dev = dgw_device_open("sim", 38400, 'N', 1, &err);
+  if (!dev
+      || !dgw_device_read_sequence(dev, &last_seq, &err)
+      || !dgw_device_read_ring(dev, ring, &err)) {
+    g_printerr("%s\n", err->message);
+    return FALSE;
+  }
+  for (p = 1; p <= POLLS; p++) {
+    guint n = rand() % (DGW_MAX_RECORDS + 1);
+    gboolean overrun;
+    int len;
+    if (p % OVERRUN_EVERY == 0) n = DGW_MAX_RECORDS + 1 + rand() % 40;
+    produce(&check, n);
+    pending += n;
+    len = poll_snapshot(dev, ring, &last_seq, records, &overrun, &err);
+    if (len < 0) {
+      g_printerr("%s\n", err->message);
+      return FALSE;
+    }
+    if ((guint)len != MIN(pending, DGW_MAX_RECORDS)) {
+      g_printerr("Snapshot poll %u returned %d records, expected %u\n",
+		 p, len, MIN(pending, DGW_MAX_RECORDS));
+      return FALSE;
+    }
+    if (len > 0) got_records(dev, records, len, overrun, &check);
+    if (pending > DGW_MAX_RECORDS) overruns++;
+    pending = 0;
+  }
+  dgw_device_close(dev);
+  print_check("Snapshot", &check, 0);
+  return (check.lost == 0 && check.repeated == 0
+	  && check.false_overruns == 0 && check.overruns == overruns
+	  && check.next == check.produced
+	  && check.delivered + check.overrun_lost == check.produced);
+}
+
+int
+main(int argc, char *argv[])
+{
+  PollCheck check = {0};
+  GError *err = NULL;
+  DgwDevice *dev;
+  DgwDevice *other;
+  guint pending = 0; /* Records produced since the last successful poll */
+  guint overruns = 0;
+  guint failures = 0;
+  guint p;
+  gboolean ok;
+  (void)argc;
+  (void)argv;
+  srand(1);
+  sim_gateway_reset(START_SEQ);
+  dev = dgw_device_open("sim", 38400, 'N', 1, &err);
+  if (!dev) {
+    g_printerr("%s\n", err->message);
+    return 1;
+  }
+  /* Gateways on one port share it, but only with the same settings */
+  other = dgw_device_open("sim", 9600, 'N', 2, &err);
+  if (other) {
+    g_printerr("Opened a port twice with different settings\n");
+    return 1;
+  }
+  g_clear_error(&err);
+
+  dgw_device_set_record_func(dev, got_records, &check);
+  if (dgw_device_poll(dev, &err) != 0) {
+    g_printerr("First poll failed\n");
+    return 1;
+  }
+  for (p = 1; p <= POLLS; p++) {
+    guint n = rand() % (DGW_MAX_RECORDS + 1);
+    int len;
+    if (p % OVERRUN_EVERY == 0) n = DGW_MAX_RECORDS + 1 + rand() % 40;
+    if (p % FAIL_EVERY == 0) {
+      /* There has to be something to read */
+      n = 1 + rand() % DGW_MAX_RECORDS;
+      sim_gateway_fail_ring_reads(1);
+    }
+    produce(&check, n);
+    pending += n;
+    len = dgw_device_poll(dev, &err);
+    if (p % FAIL_EVERY == 0) {
+      if (len >= 0) {
+	g_printerr("Poll %u succeeded with a failing ring read\n", p);
+	return 1;
+      }
+      g_clear_error(&err);
+      failures++;
+      continue;
+    }
+    if (len < 0) {
+      g_printerr("%s\n", err->message);
+      return 1;
+    }
+    if ((guint)len != MIN(pending, DGW_MAX_RECORDS)) {
+      g_printerr("Poll %u returned %d records, expected %u\n",
+		 p, len, MIN(pending, DGW_MAX_RECORDS));
+      return 1;
+    }
+    if (pending > DGW_MAX_RECORDS) overruns++;
+    pending = 0;
+  }
+  dgw_device_close(dev);
+
+  print_check("Sequence", &check, failures);
+  ok = (check.lost == 0 && check.repeated == 0 && check.false_overruns == 0
+	&& check.overruns == overruns
+	&& check.next == check.produced
+	&& check.delivered + check.overrun_lost == check.produced);
+  if (!check_snapshot()) ok = FALSE;
+  return ok ? 0 : 1;
+}
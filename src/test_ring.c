@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "dgw_ring.h"
+
+/* Checks dgw_ring_plan() for every last_seq and every distance up to
+   MAX_DISTANCE, including all wraps of the ring and of the 16 bit
+   sequence number, and dgw_ring_diff() for every position in the ring
+   and number of new records. */
+
+#define MAX_DISTANCE 200
+/* Stop reporting after this many failures */
+#define MAX_REPORTS 10
+
+/* The arithmetic the sniffer used before the planner */
+static guint
+reference_plan(uint16_t last_seq, uint16_t seq, DgwRingRead *reads)
+{
+  uint16_t len = seq - last_seq;
+  int start;
+  int end;
+  guint n = 0;
+  if (len == 0) return 0;
+  if (len > DGW_MAX_RECORDS) len = DGW_MAX_RECORDS;
+  end = seq + 1;
+  start = (end - len) & 0x1f;
+  end &= 0x1f;
+  start *= 2;
+  end *= 2;
+  if (start < end) {
+    reads[n].offset = start;
+    reads[n++].count = end - start;
+  } else {
+    reads[n].offset = start;
+    reads[n++].count = DGW_RING_REGS - start;
+    if (end > 0) {
+      reads[n].offset = 0;
+      reads[n++].count = end;
+    }
+  }
+  return n;
+}
+
+/* Returns NULL if the plan is right, otherwise what is wrong with it */
+static const char *
+check_plan(const DgwRingPlan *plan, uint16_t last_seq, uint16_t seq)
+{
+  guint distance = (uint16_t)(seq - last_seq);
+  guint expected = MIN(distance, DGW_MAX_RECORDS);
+  DgwRingRead reference[2];
+  guint n_reference;
+  guint pos = 0;
+  guint i;
+  guint r;
+  if (plan->n_records != expected) return "wrong number of records";
+  if (plan->overrun != (distance > DGW_MAX_RECORDS)) return "wrong overrun";
+  if (plan->n_reads > 2) return "too many reads";
+  if (expected > 0 && plan->n_reads == 0) return "no reads";
+  for (r = 0; r < plan->n_reads; r++) {
+    const DgwRingRead *read = &plan->reads[r];
+    if (read->count == 0) return "empty read";
+    if (read->offset % 2 != 0 || read->count % 2 != 0) {
+      return "read splits a record";
+    }
+    if (read->offset + read->count > DGW_RING_REGS) {
+      return "read past the end of the ring";
+    }
+    /* The registers read, in order, must be the records oldest first */
+    for (i = 0; i < read->count; i++, pos++) {
+      uint16_t rec_seq = seq - expected + 1 + pos / 2;
+      if (read->offset + i != DGW_RING_SLOT(rec_seq) * 2 + pos % 2) {
+	return "reads the wrong slots";
+      }
+    }
+  }
+  if (pos != expected * 2) return "wrong number of registers";
+  n_reference = reference_plan(last_seq, seq, reference);
+  if (n_reference != plan->n_reads) return "differs from reference";
+  for (r = 0; r < n_reference; r++) {
+    if (reference[r].offset != plan->reads[r].offset
+	|| reference[r].count != plan->reads[r].count) {
+      return "differs from reference";
+    }
+  }
+  return NULL;
+}
+
+/* n new records after last_seq, with dup_pos identical to the record it
+   replaces unless it is out of range. Returns NULL if dgw_ring_diff()
+   gets it right, otherwise what is wrong. */
+static const char *
+check_diff(uint16_t last_seq, guint n, guint dup_pos)
+{
+  uint16_t old[DGW_RING_REGS];
+  uint16_t ring[DGW_RING_REGS];
+  uint16_t records[DGW_MAX_RECORDS * 2];
+  int expected;
+  int len;
+  guint i;
+  for (i = 0; i < DGW_RING_REGS; i++) old[i] = i;
+  memcpy(ring, old, sizeof(ring));
+  for (i = 0; i < n; i++) {
+    guint slot = DGW_RING_SLOT(last_seq + 1 + i);
+    if (i == dup_pos) continue;
+    ring[slot * 2] = 1000 + i;
+    ring[slot * 2 + 1] = 2000 + i;
+  }
+  /* A duplicate last record looks like one record less, it is found
+     later. Any other duplicate breaks the run of changed slots. */
+  expected = dup_pos + 1 == n ? n - 1 : n;
+  if (dup_pos + 1 < n || expected > DGW_MAX_RECORDS) expected = -1;
+  len = dgw_ring_diff(old, ring, last_seq, records);
+  if (len != expected) return "wrong number of records";
+  for (i = 0; (int)i < len; i++) {
+    if (records[i * 2] != 1000 + i || records[i * 2 + 1] != 2000 + i) {
+      return "wrong records";
+    }
+  }
+  return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+  guint64 checked = 0;
+  guint failures = 0;
+  guint diff_failures = 0;
+  guint last_seq;
+  guint distance;
+  (void)argc;
+  (void)argv;
+  for (last_seq = 0; last_seq <= G_MAXUINT16; last_seq++) {
+    for (distance = 0; distance <= MAX_DISTANCE; distance++) {
+      uint16_t seq = last_seq + distance;
+      DgwRingPlan plan;
+      const char *problem;
+      dgw_ring_plan(&plan, last_seq, seq);
+      problem = check_plan(&plan, last_seq, seq);
+      checked++;
+      if (problem && ++failures <= MAX_REPORTS) {
+	g_printerr("last_seq %u, seq %u: %s\n", last_seq, seq, problem);
+      }
+    }
+  }
+  printf("%" G_GUINT64_FORMAT " plans checked, %u failed\n",
+	 checked, failures);
+  for (last_seq = 0; last_seq < DGW_RING_REGS / 2; last_seq++) {
+    for (distance = 0; distance <= DGW_RING_REGS / 2; distance++) {
+      guint dup;
+      for (dup = 0; dup <= distance; dup++) {
+	const char *problem = check_diff(last_seq, distance, dup);
+	if (problem && ++diff_failures <= MAX_REPORTS) {
+	  g_printerr("Diff after %u with %u new, duplicate %u: %s\n",
+		     last_seq, distance, dup, problem);
+	}
+      }
+    }
+  }
+  printf("Ring diffs: %u failed\n", diff_failures);
+  failures += diff_failures;
+  return failures == 0 ? 0 : 1;
+}
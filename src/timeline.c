@@ -0,0 +1,155 @@
+#include "timeline.h"
+
+/* The gateway clock is assumed to be within this of the host clock */
+#define RATE_LIMIT 0.01
+/* Use the measured rate once the range is narrower than this */
+#define RATE_WIDTH_MAX 0.0002
+
+static void
+rate_restart(Timeline *tl)
+{
+  tl->rate_start = (tl->pos_min + tl->pos_max) / 2;
+  tl->rate_err = (tl->pos_max - tl->pos_min) / 2;
+  tl->rate_ms = 0;
+  tl->rate_min = 1.0 - RATE_LIMIT;
+  tl->rate_max = 1.0 + RATE_LIMIT;
+}
+
+void
+timeline_init(Timeline *tl)
+{
+  tl->valid = FALSE;
+  tl->last_poll = 0;
+  tl->rate = 1.0;
+  tl->pos_min = 0;
+  tl->pos_max = 0;
+  rate_restart(tl);
+  tl->real_offset = g_get_real_time() - g_get_monotonic_time();
+}
+
+/* Call after every poll of the ring, with or without new records */
+void
+timeline_polled(Timeline *tl, gint64 poll_start)
+{
+  tl->last_poll = poll_start;
+  tl->real_offset = g_get_real_time() - g_get_monotonic_time();
+}
+
+/* The first record of a batch that follows lost records has a delta
+   from a record that was never seen */
+static gboolean
+gap_unknown(const Timeline *tl, const uint16_t *records, guint i,
+	    gboolean overrun)
+{
+  return ((records[i*2+1] >> 6) >= TIMELINE_DELTA_MAX
+	  || (i == 0 && (!tl->valid || overrun)));
+}
+
+/* Advance the position by ms gateway time */
+static void
+advance(Timeline *tl, gint64 ms)
+{
+  tl->pos_min += ms * 1000.0 * tl->rate_min;
+  tl->pos_max += ms * 1000.0 * tl->rate_max;
+  tl->rate_ms += ms;
+}
+
+/* The record at the current position was between lo and hi */
+static void
+bound(Timeline *tl, double lo, double hi)
+{
+  double g = tl->rate_ms * 1000.0;
+  tl->pos_min = MAX(tl->pos_min, lo);
+  tl->pos_max = MIN(tl->pos_max, hi);
+  if (tl->pos_min > tl->pos_max) {
+    /* The rate range was wrong, follow the polls */
+    tl->pos_min = tl->pos_max = CLAMP((tl->pos_min + tl->pos_max) / 2,
+				      lo, hi);
+    rate_restart(tl);
+    return;
+  }
+  if (tl->rate_ms == 0) return;
+  tl->rate_min = MAX(tl->rate_min, (lo - tl->rate_start - tl->rate_err) / g);
+  tl->rate_max = MIN(tl->rate_max, (hi - tl->rate_start + tl->rate_err) / g);
+  if (tl->rate_min > tl->rate_max) {
+    /* The gateway clock isn't steady, measure again from here */
+    rate_restart(tl);
+  } else if (tl->rate_max - tl->rate_min < RATE_WIDTH_MAX) {
+    tl->rate = (tl->rate_min + tl->rate_max) / 2;
+  }
+}
+
+/* Set times to the host time of each of the n records read by the poll
+   ending at poll_end. overrun is set if records were lost before this
+   batch. Each record costs a constant amount of work. */
+void
+timeline_batch(Timeline *tl, const uint16_t *records, guint n,
+	       gboolean overrun, gint64 poll_end, gint64 *times)
+{
+  double lo = tl->last_poll;
+  double hi = poll_end;
+  double unit = 1000.0 * tl->rate;
+  double t = (tl->pos_min + tl->pos_max) / 2;
+  gint64 after = 0;
+  guint anchor = n;
+  guint first;
+  guint i;
+  if (n == 0) return;
+  /* Find the last record with an unknown gap before it and the gateway
+     time from it to the end of the batch */
+  for (i = n; i-- > 0;) {
+    if (gap_unknown(tl, records, i, overrun)) {
+      anchor = i;
+      break;
+    }
+    after += records[i*2+1] >> 6;
+  }
+  if (anchor < n) {
+    /* The records before the anchor only get a time by accumulating.
+       After an unknown gap, assume the shortest, which is the delta
+       itself both when it saturated and after lost records. */
+    for (i = 0; i < anchor; i++) {
+      if (gap_unknown(tl, records, i, overrun)) {
+	t = tl->valid ? MAX(lo, t + (records[i*2+1] >> 6) * unit) : lo;
+      } else {
+	t += (records[i*2+1] >> 6) * unit;
+      }
+      times[i] = t;
+    }
+    /* Anywhere after the minimum gap that leaves room for the rest */
+    tl->pos_min = lo;
+    if (tl->valid) {
+      tl->pos_min = MAX(lo, t + (records[anchor*2+1] >> 6) * unit);
+    }
+    tl->pos_max = MAX(tl->pos_min, hi - after * unit);
+    tl->valid = TRUE;
+    rate_restart(tl);
+    first = anchor;
+  } else {
+    /* The first record is new, so it came after the previous poll */
+    advance(tl, records[1] >> 6);
+    bound(tl, lo, hi);
+    first = 0;
+  }
+  advance(tl, after - (anchor < n ? 0 : records[1] >> 6));
+  bound(tl, lo, hi);
+  /* Place the chain backwards from the last record */
+  t = (tl->pos_min + tl->pos_max) / 2;
+  for (i = n; i-- > first;) {
+    times[i] = t;
+    t -= (records[i*2+1] >> 6) * unit;
+  }
+}
+
+gint64
+timeline_real(const Timeline *tl, gint64 time)
+{
+  return time + tl->real_offset;
+}
+
+/* How much faster the gateway clock runs than the host clock */
+double
+timeline_drift_ppm(const Timeline *tl)
+{
+  return (1.0 / tl->rate - 1.0) * 1e6;
+}
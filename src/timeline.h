@@ -0,0 +1,56 @@
+#ifndef __TIMELINE_H__
+#define __TIMELINE_H__
+
+#include <stdint.h>
+#include <glib.h>
+
+/* Record delta times are in ms and saturate at this value (>= 1s) */
+#define TIMELINE_DELTA_MAX 1000
+
+/* Reconstructs host times for records from their delta times. Each
+   batch of records must have happened after the start of the previous
+   poll and before the end of the poll that read it. Records are placed
+   by accumulating deltas, scaled by the estimated rate of the gateway
+   clock. The poll times bound the time of each record, which places
+   records after saturated deltas and narrows down both the position of
+   the following records and the rate.
+
+   All times are g_get_monotonic_time() values. */
+typedef struct Timeline Timeline;
+struct Timeline
+{
+  gboolean valid;   /* pos_min and pos_max are known */
+  gint64 last_poll; /* Start of the previous poll */
+  double rate;      /* Host time per gateway time */
+  /* Host time of the last record, moved forward by the gateway time
+     using the rate range and cut by the poll times */
+  double pos_min;
+  double pos_max;
+  /* Range of rates consistent with the records since a record that was
+     at rate_start +- rate_err, rate_ms gateway ms ago */
+  double rate_start;
+  double rate_err;
+  gint64 rate_ms;
+  double rate_min;
+  double rate_max;
+  /* Difference between real and monotonic time at the last poll */
+  gint64 real_offset;
+};
+
+void
+timeline_init(Timeline *tl);
+
+void
+timeline_polled(Timeline *tl, gint64 poll_start);
+
+void
+timeline_batch(Timeline *tl, const uint16_t *records, guint n,
+	       gboolean overrun, gint64 poll_end, gint64 *times);
+
+gint64
+timeline_real(const Timeline *tl, gint64 time);
+
+double
+timeline_drift_ppm(const Timeline *tl);
+
+#endif /* __TIMELINE_H__ */